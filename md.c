@@ -11,6 +11,10 @@
 #include "md.h"
 #include "rmd160.h"
 
+#if defined(__GNUC__) && !defined(MD_NO_SIMD)
+#define MD_SIMD
+#endif
+
 void md_init(md_state * md)
 {
   /* check assumptions made in rmd160.h (should produce no code) */
@@ -82,11 +86,272 @@ void md_close(md_state *md, unsigned char *result)
 }
 
 
+/*
+ * Multi-buffer RIPEMD-160: md_batch() computes the hash values of up
+ * to MD_LANES independent messages at once, with lane l of each
+ * 32-bit word vector belonging to message l. The compression function
+ * is written using GCC vector extensions, and compiled twice: once
+ * for AVX2 (one instruction per 8 lanes) and once for the baseline
+ * instruction set (on x86-64: SSE2, two instructions per 8 lanes).
+ * The AVX2 variant is only used if the CPU supports it. Without GCC,
+ * or with -DMD_NO_SIMD, each lane is processed by rmd160_compress().
+ */
+
+#ifndef MD_RIPEMD160
+#error "md_batch() implements only RIPEMD-160 (5-word state)"
+#endif
+
+/* state and message block of MD_LANES messages, word-interleaved */
+typedef struct {
+  dword md[5][MD_LANES];
+  dword x[16][MD_LANES];
+} mb_block;
+
+#ifdef MD_SIMD
+
+/* message word selection and rotation amounts of the left and right line */
+static const unsigned char mb_rl[80] = {
+   0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15,
+   7,  4, 13,  1, 10,  6, 15,  3, 12,  0,  9,  5,  2, 14, 11,  8,
+   3, 10, 14,  4,  9, 15,  8,  1,  2,  7,  0,  6, 13, 11,  5, 12,
+   1,  9, 11, 10,  0,  8, 12,  4, 13,  3,  7, 15, 14,  5,  6,  2,
+   4,  0,  5,  9,  7, 12,  2, 10, 14,  1,  3,  8, 11,  6, 15, 13 };
+static const unsigned char mb_rr[80] = {
+   5, 14,  7,  0,  9,  2, 11,  4, 13,  6, 15,  8,  1, 10,  3, 12,
+   6, 11,  3,  7,  0, 13,  5, 10, 14, 15,  8, 12,  4,  9,  1,  2,
+  15,  5,  1,  3,  7, 14,  6,  9, 11,  8, 12,  2, 10,  0,  4, 13,
+   8,  6,  4,  1,  3, 11, 15,  0,  5, 12,  2, 13,  9,  7, 10, 14,
+  12, 15, 10,  4,  1,  5,  8,  7,  6,  2, 13, 14,  0,  3,  9, 11 };
+static const unsigned char mb_sl[80] = {
+  11, 14, 15, 12,  5,  8,  7,  9, 11, 13, 14, 15,  6,  7,  9,  8,
+   7,  6,  8, 13, 11,  9,  7, 15,  7, 12, 15,  9, 11,  7, 13, 12,
+  11, 13,  6,  7, 14,  9, 13, 15, 14,  8, 13,  6,  5, 12,  7,  5,
+  11, 12, 14, 15, 14, 15,  9,  8,  9, 14,  5,  6,  8,  6,  5, 12,
+   9, 15,  5, 11,  6,  8, 13, 12,  5, 12, 13, 14, 11,  8,  5,  6 };
+static const unsigned char mb_sr[80] = {
+   8,  9,  9, 11, 13, 15, 15,  5,  7,  7,  8, 11, 14, 14, 12,  6,
+   9, 13, 15,  7, 12,  8,  9, 11,  7,  7, 12,  7,  6, 15, 13, 11,
+   9,  7, 15, 11,  8,  6,  6, 14, 12, 13,  5, 14, 13, 13,  7,  5,
+  15,  5,  8, 11, 14, 14,  6, 14,  6,  9, 12,  9, 12,  5, 15,  8,
+   8,  5, 12,  9, 12,  5, 14,  6,  8, 13,  6,  5, 15, 13, 11, 11 };
+static const dword mb_kl[5] = {
+  0x00000000UL, 0x5a827999UL, 0x6ed9eba1UL, 0x8f1bbcdcUL, 0xa953fd4eUL };
+static const dword mb_kr[5] = {
+  0x50a28be6UL, 0x5c4dd124UL, 0x6d703ef3UL, 0x7a6d76e9UL, 0x00000000UL };
+
+typedef dword mb_vec __attribute__ ((vector_size (4 * MD_LANES)));
+
+#define MB_ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+/* basic function of round r (0-4), cf. F() to J() in rmd160.h */
+#define MB_F(r, x, y, z) \
+  ((r) == 0 ? (x) ^ (y) ^ (z) : \
+   (r) == 1 ? ((x) & (y)) | (~(x) & (z)) : \
+   (r) == 2 ? ((x) | ~(y)) ^ (z) : \
+   (r) == 3 ? ((x) & (z)) | ((y) & ~(z)) : \
+   (x) ^ ((y) | ~(z)))
+
+static inline __attribute__ ((always_inline))
+void mb_compress_vec(mb_block *b)
+{
+  mb_vec *md = (mb_vec *) b->md, *x = (mb_vec *) b->x;
+  mb_vec al = md[0], bl = md[1], cl = md[2], dl = md[3], el = md[4];
+  mb_vec ar = md[0], br = md[1], cr = md[2], dr = md[3], er = md[4];
+  mb_vec t;
+  int j;
+
+#if __GNUC__ >= 8
+#pragma GCC unroll 80  /* constant table indices and rotation counts */
+#endif
+  for (j = 0; j < 80; j++) {
+    t = al + MB_F(j >> 4, bl, cl, dl) + x[mb_rl[j]] + mb_kl[j >> 4];
+    t = MB_ROL(t, mb_sl[j]) + el;
+    al = el; el = dl; dl = MB_ROL(cl, 10); cl = bl; bl = t;
+    t = ar + MB_F(4 - (j >> 4), br, cr, dr) + x[mb_rr[j]] + mb_kr[j >> 4];
+    t = MB_ROL(t, mb_sr[j]) + er;
+    ar = er; er = dr; dr = MB_ROL(cr, 10); cr = br; br = t;
+  }
+  t     = md[1] + cl + dr;
+  md[1] = md[2] + dl + er;
+  md[2] = md[3] + el + ar;
+  md[3] = md[4] + al + br;
+  md[4] = md[0] + bl + cr;
+  md[0] = t;
+}
+
+static void mb_compress_generic(mb_block *b)
+{
+  mb_compress_vec(b);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MB_AVX2
+__attribute__ ((target ("avx2")))
+static void mb_compress_avx2(mb_block *b)
+{
+  mb_compress_vec(b);
+}
+#endif
+
+#endif /* MD_SIMD */
+
+static void mb_compress_scalar(mb_block *b)
+{
+  dword md[5], x[16];
+  int i, l;
+
+  for (l = 0; l < MD_LANES; l++) {
+    for (i = 0; i < 5; i++)
+      md[i] = b->md[i][l];
+    for (i = 0; i < 16; i++)
+      x[i] = b->x[i][l];
+    rmd160_compress(md, x);
+    for (i = 0; i < 5; i++)
+      b->md[i][l] = md[i];
+  }
+}
+
+/* available implementations, best last */
+static void (*const mb_kernels[])(mb_block *) = {
+  mb_compress_scalar,
+#ifdef MD_SIMD
+  mb_compress_generic,
+#endif
+#ifdef MB_AVX2
+  mb_compress_avx2,
+#endif
+};
+#define MB_KERNELS ((int) (sizeof(mb_kernels) / sizeof(mb_kernels[0])))
+
+/* is kernel k supported by this CPU? */
+static int mb_supported(int k)
+{
+#ifdef MB_AVX2
+  if (mb_kernels[k] == mb_compress_avx2)
+    return __builtin_cpu_supports("avx2");
+#endif
+  return k >= 0 && k < MB_KERNELS;
+}
+
+static int mb_best = -1;  /* index of best supported kernel */
+
+/*
+ * Copy block number blk of a padded message, consisting of the plen
+ * bytes in pre[] followed by the len bytes in src[], into the 64
+ * bytes of buf. The padding encodes the total message length in bytes,
+ * which includes anything hashed before pre[].
+ */
+static void mb_fill(unsigned char *buf, size_t blk,
+		    const unsigned char *pre, size_t plen,
+		    const unsigned char *src, size_t len,
+		    unsigned long long total)
+{
+  size_t start = blk * MD_BUFLEN, end = start + MD_BUFLEN, i;
+  size_t mlen = plen + len;
+
+  memset(buf, 0, MD_BUFLEN);
+  for (i = start; i < plen && i < end; i++)
+    buf[i - start] = pre[i];
+  if (end > plen && start < mlen) {
+    i = start > plen ? start : plen;
+    memcpy(buf + (i - start), src + (i - plen),
+	   (end < mlen ? end : mlen) - i);
+  }
+  if (mlen >= start && mlen < end)
+    buf[mlen - start] = 0x80;
+  if (blk == (mlen + 8) / MD_BUFLEN) {
+    /* last block: append length in bits */
+    total <<= 3;
+    for (i = 0; i < 8; i++)
+      buf[56 + i] = total >> (8 * i);
+  }
+}
+
+/* hash up to MD_LANES messages using kernel k */
+static void mb_batch(int k, const md_state *prefix, int n,
+		     const void *const *src, const size_t *len,
+		     unsigned char *result)
+{
+  mb_block b __attribute__ ((aligned (32)));
+  dword saved[5][MD_LANES];
+  dword init[5];
+  unsigned char buf[MD_BUFLEN];
+  unsigned long long before = 0;
+  size_t plen = 0, blocks[MD_LANES], maxblocks = 0, blk;
+  int i, l;
+
+  if (prefix) {
+    memcpy(init, prefix->md, sizeof(init));
+    before = (unsigned long long) prefix->length_hi << 32 | prefix->length_lo;
+    plen = prefix->length_lo & (MD_BUFLEN - 1);
+  } else
+    rmd160_init(init);
+  for (l = 0; l < MD_LANES; l++) {
+    for (i = 0; i < 5; i++)
+      b.md[i][l] = init[i];
+    blocks[l] = l < n ? (plen + len[l] + 8) / MD_BUFLEN + 1 : 0;
+    if (blocks[l] > maxblocks)
+      maxblocks = blocks[l];
+  }
+  for (blk = 0; blk < maxblocks; blk++) {
+    for (l = 0; l < MD_LANES; l++) {
+      if (blk < blocks[l])
+	mb_fill(buf, blk, prefix ? prefix->buf : NULL, plen,
+		src[l], len[l], before + len[l]);
+      else
+	memset(buf, 0, MD_BUFLEN);
+      for (i = 0; i < 16; i++)
+	b.x[i][l] = BYTES_TO_DWORD(buf + 4 * i);
+    }
+    memcpy(saved, b.md, sizeof(saved));
+    mb_kernels[k](&b);
+    /* lanes of shorter messages keep their final state */
+    for (l = 0; l < MD_LANES; l++)
+      if (blk >= blocks[l])
+	for (i = 0; i < 5; i++)
+	  b.md[i][l] = saved[i][l];
+  }
+  for (l = 0; l < n; l++)
+    for (i = 0; i < MD_LEN; i++)
+      result[l * MD_LEN + i] = b.md[i >> 2][l] >> (8 * (i & 3));
+  memset(&b, 0, sizeof(b));
+  memset(buf, 0, sizeof(buf));
+}
+
+
+/*
+ * Hash n independent messages, where message i consists of whatever
+ * has already been added to *prefix (if prefix != NULL), followed by
+ * the len[i] bytes at src[i]. Store the n results, of MD_LEN bytes
+ * each, one after another in result. This is equivalent to, but for
+ * n > 1 faster than, calling md_add(src[i], len[i]) and md_close() on
+ * n copies of *prefix (or of a freshly initialized md_state).
+ */
+void md_batch(const md_state *prefix, int n, const void *const *src,
+	      const size_t *len, unsigned char *result)
+{
+  int k;
+
+  if (mb_best < 0) {
+    for (k = MB_KERNELS - 1; k > 0 && !mb_supported(k); k--) ;
+    mb_best = k;
+  }
+  for (; n > 0; n -= MD_LANES) {
+    mb_batch(mb_best, prefix, n < MD_LANES ? n : MD_LANES, src, len, result);
+    src += MD_LANES;
+    len += MD_LANES;
+    result += MD_LANES * MD_LEN;
+  }
+}
+
+
 int md_selftest(void)
 {
-  int i, j, fail = 0;
-  md_state md;
-  unsigned char result[MD_LEN];
+  int i, j, k, fail = 0;
+  md_state md, prefix;
+  unsigned char result[MD_LEN], batch[MD_LANES * MD_LEN];
+  const void *src[MD_LANES];
+  size_t len[MD_LANES];
 
   char *pattern[8] = {
     "",
@@ -167,5 +432,33 @@ int md_selftest(void)
     }
   }
 
+  /* test every supported md_batch() kernel, with and without prefix */
+  for (k = 0; k < MB_KERNELS; k++) {
+    if (!mb_supported(k))
+      continue;
+    for (i = 0; i < 8; i++) {
+      src[i] = pattern[i];
+      len[i] = strlen(pattern[i]);
+    }
+    mb_batch(k, NULL, 8, src, len, batch);
+    for (i = 0; i < 8; i++)
+      if (memcmp(batch + i * MD_LEN, md_result[i], MD_LEN) != 0) {
+	abort();
+	fail++;
+      }
+    md_init(&md);
+    md_add(&md, pattern[7], 37);
+    mb_batch(k, &md, 7, src + 1, len + 1, batch);
+    for (i = 1; i < 8; i++) {
+      prefix = md;
+      md_add(&prefix, pattern[i], len[i]);
+      md_close(&prefix, result);
+      if (memcmp(batch + (i - 1) * MD_LEN, result, MD_LEN) != 0) {
+	abort();
+	fail++;
+      }
+    }
+  }
+
   return fail;
 }
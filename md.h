@@ -22,11 +22,16 @@ typedef struct {
   unsigned long length_lo, length_hi;     /* number of bits hashed so far */
 } md_state;
 
+/* number of messages that md_batch() hashes in parallel */
+#define MD_LANES 8
+
 /* prototypes */
 
 void md_init(md_state *md);
 void md_add(md_state *md, const void *src, size_t len);
 void md_close(md_state *md, unsigned char *result);
+void md_batch(const md_state *prefix, int n, const void *const *src,
+	      const size_t *len, unsigned char *result);
 int md_selftest(void);
 
 #endif
@@ -0,0 +1,370 @@
+/*
+ * Microbenchmarks for the OTPW hash function, password encodings and
+ * login library, with results in JSON format on stdout
+ *
+ * Usage: otpw-bench [-t seconds]
+ *
+ * Each benchmark runs for about the given time (default: 0.2 s) and
+ * reports the number of operations, their throughput and percentiles
+ * of the latency of single operations. The otpw_prepare() and
+ * otpw_verify() benchmarks log in against synthetic OTPW2 files with
+ * known passwords in a temporary directory (under $TMPDIR or /tmp).
+ *
+ * Markus Kuhn <http://www.cl.cam.ac.uk/~mgk25/>
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "otpw.h"
+#include "md.h"
+#include "pwgen.h"
+
+#define MAXSAMPLES 100000  /* latencies recorded per benchmark */
+#define PWCHARS    8       /* characters per synthetic password */
+#define PREFIX     "prefix password"
+
+static double budget = 0.2;  /* seconds per benchmark (option -t) */
+static unsigned long long samples[MAXSAMPLES];  /* latencies [ns] */
+static int nsamples;
+static unsigned long long ops, total_ns;
+static int results;          /* number of results output so far */
+
+static unsigned long long now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void bench_start(void)
+{
+  nsamples = 0;
+  ops = total_ns = 0;
+}
+
+/* record the latency of one operation, return 1 once budget is spent */
+static int bench_record(unsigned long long ns)
+{
+  if (nsamples < MAXSAMPLES)
+    samples[nsamples++] = ns;
+  ops++;
+  total_ns += ns;
+  return total_ns >= budget * 1e9 || ops >= MAXSAMPLES;
+}
+
+static int cmp_ull(const void *a, const void *b)
+{
+  unsigned long long x = *(const unsigned long long *) a;
+  unsigned long long y = *(const unsigned long long *) b;
+
+  return (x > y) - (x < y);
+}
+
+static unsigned long long percentile(double p)
+{
+  int i = (int) (p * (nsamples - 1) + 0.5);
+
+  return nsamples ? samples[i] : 0;
+}
+
+/* output one result, with a parameter name and value, and the bytes
+ * processed per operation (0 if not applicable) */
+static void bench_report(const char *name, const char *param, int value,
+			 size_t bytes)
+{
+  double secs = total_ns / 1e9;
+
+  qsort(samples, nsamples, sizeof(samples[0]), cmp_ull);
+  printf("%s    {\"name\": \"%s\", \"%s\": %d, \"ops\": %llu, "
+	 "\"ops_per_sec\": %.1f,",
+	 results++ ? ",\n" : "", name, param, value, ops,
+	 secs > 0 ? ops / secs : 0.0);
+  if (bytes)
+    printf(" \"mb_per_sec\": %.2f,",
+	   secs > 0 ? ops * bytes / secs / 1e6 : 0.0);
+  printf(" \"ns_min\": %llu, \"ns_p50\": %llu, \"ns_p90\": %llu, "
+	 "\"ns_p99\": %llu, \"ns_max\": %llu}",
+	 percentile(0), percentile(0.5), percentile(0.9),
+	 percentile(0.99), percentile(1));
+  fflush(stdout);
+}
+
+
+static void bench_md(size_t size)
+{
+  md_state md;
+  unsigned char *buf, h[MD_LEN];
+  unsigned long long t;
+
+  buf = malloc(size);
+  if (!buf) abort();
+  memset(buf, 'x', size);
+  bench_start();
+  do {
+    t = now_ns();
+    md_init(&md);
+    md_add(&md, buf, size);
+    md_close(&md, h);
+    buf[0] = h[0];
+  } while (!bench_record(now_ns() - t));
+  bench_report("md", "size", size, size);
+  free(buf);
+}
+
+
+static void bench_md_batch(size_t size)
+{
+  const void *src[MD_LANES];
+  size_t len[MD_LANES];
+  unsigned char *buf, h[MD_LANES * MD_LEN];
+  unsigned long long t;
+  int i;
+
+  buf = malloc(MD_LANES * size);
+  if (!buf) abort();
+  memset(buf, 'x', MD_LANES * size);
+  for (i = 0; i < MD_LANES; i++) {
+    src[i] = buf + i * size;
+    len[i] = size;
+  }
+  bench_start();
+  do {
+    t = now_ns();
+    md_batch(NULL, MD_LANES, src, len, h);
+    buf[0] = h[0];
+  } while (!bench_record(now_ns() - t));
+  bench_report("md_batch", "size", size, MD_LANES * size);
+  free(buf);
+}
+
+
+static void bench_conv(int base, int chars)
+{
+  unsigned char v[MD_LEN];
+  char s[81];
+  unsigned long long t;
+
+  memset(v, 0x5a, sizeof(v));
+  bench_start();
+  do {
+    t = now_ns();
+    if (base == 64)
+      conv_base64(s, v, chars);
+    else
+      conv_base32(s, v, chars);
+    v[0] ^= s[0];
+  } while (!bench_record(now_ns() - t));
+  bench_report(base == 64 ? "conv_base64" : "conv_base32", "chars", chars, 0);
+}
+
+
+static void bench_make_passwd(int type, const char *name)
+{
+  unsigned char v[MD_LEN];
+  char buf[81];
+  unsigned long long t;
+
+  memset(v, 0x5a, sizeof(v));
+  bench_start();
+  do {
+    t = now_ns();
+    if (make_passwd(v, sizeof(v), type, 48, buf, sizeof(buf)) < 0)
+      abort();
+    v[0] ^= buf[0];
+  } while (!bench_record(now_ns() - t));
+  bench_report(name, "entropy", 48, 0);
+}
+
+
+/*
+ * Write an OTPW2 file with n unused entries to path, where entry k has
+ * the challenge k and the one-time password pw + k * PWCHARS.
+ */
+static void write_hashfile(const char *path, int n, int challen,
+			   const char *pw)
+{
+  md_state md;
+  const void **src;
+  size_t *len;
+  unsigned char *h, header[OTPW2_HDRLEN];
+  char entry[81];
+  struct otpw2_header hdr;
+  FILE *f;
+  int k;
+
+  src = malloc(n * sizeof(*src));
+  len = malloc(n * sizeof(*len));
+  h = malloc(n * MD_LEN);
+  if (!src || !len || !h) abort();
+  for (k = 0; k < n; k++) {
+    src[k] = pw + k * PWCHARS;
+    len[k] = PWCHARS;
+  }
+  md_init(&md);
+  md_add(&md, PREFIX, strlen(PREFIX));
+  md_batch(&md, n, src, len, h);
+
+  f = fopen(path, "w");
+  if (!f) {
+    fprintf(stderr, "Can't write to '%s", path);
+    perror("'");
+    exit(1);
+  }
+  hdr.entries = hdr.remaining = n;
+  hdr.challen = challen;
+  hdr.hlen = otpw_hlen;
+  hdr.pwlen = PWCHARS;
+  hdr.next = 0;
+  otpw2_pack_header(header, &hdr);
+  fwrite(header, 1, OTPW2_HDRLEN, f);
+  for (k = 0; k < OTPW2_BITMAPLEN(n); k++)
+    fputc(0, f);
+  for (k = 0; k < n; k++) {
+    if (snprintf(entry, sizeof(entry), "%0*d", challen, k) >=
+	(int) sizeof(entry) - otpw_hlen) abort();
+    conv_base64(entry + challen, h + k * MD_LEN, otpw_hlen);
+    fwrite(entry, 1, challen + otpw_hlen, f);
+  }
+  if (fclose(f)) {
+    fprintf(stderr, "Can't write to '%s", path);
+    perror("'");
+    exit(1);
+  }
+  free(src);
+  free(len);
+  free(h);
+}
+
+
+/* one login after another against an OTPW file of n entries in dir,
+ * the current directory */
+static void bench_login(const char *dir, int n)
+{
+  struct otpw_ctx ctx;
+  struct challenge ch;
+  struct passwd pwd;
+  md_state md;
+  char password[sizeof(PREFIX) + OTPW_MAXMULTI * PWCHARS];
+  char *pw;
+  unsigned char v[MD_LEN];
+  unsigned long long t, *lat;
+  int k, i, challen, nlat = 0, done = 0;
+
+  /* known passwords, derived from the entry number */
+  pw = malloc(n * PWCHARS + 1);
+  lat = malloc(MAXSAMPLES * sizeof(*lat));
+  if (!pw || !lat) abort();
+  for (k = 0; k < n; k++) {
+    md_init(&md);
+    md_add(&md, &k, sizeof(k));
+    md_close(&md, v);
+    conv_base64(pw + k * PWCHARS, v, PWCHARS);
+  }
+  for (challen = 3, k = 1000; k < n; k *= 10)
+    challen++;
+
+  memset(&pwd, 0, sizeof(pwd));
+  pwd.pw_name = "bench";
+  pwd.pw_dir = (char *) dir;
+  pwd.pw_uid = geteuid();
+  pwd.pw_gid = getegid();
+  otpw_ctx_init(&ctx);
+  ctx.pseudouser = NULL;
+
+  /* measure otpw_prepare() into samples[] and otpw_verify() into lat[]
+   * (both at most MAXSAMPLES times), writing a new file (untimed)
+   * whenever the old one is used up */
+  write_hashfile(otpw_file, n, challen, pw);
+  bench_start();
+  while (!done) {
+    t = now_ns();
+    otpw_prepare_ctx(&ctx, &ch, &pwd, 0);
+    t = now_ns() - t;
+    if (!ch.challenge[0]) {
+      write_hashfile(otpw_file, n, challen, pw);
+      continue;
+    }
+    done = bench_record(t);
+    strcpy(password, PREFIX);
+    for (i = 0; i < ch.passwords; i++)
+      strncat(password, pw + ch.selection[i] * PWCHARS, PWCHARS);
+    t = now_ns();
+    if (otpw_verify_ctx(&ctx, &ch, password) != OTPW_OK) {
+      fprintf(stderr, "otpw_verify() failed with %d entries\n", n);
+      exit(1);
+    }
+    t = now_ns() - t;
+    lat[nlat++] = t;
+  }
+  bench_report("prepare", "entries", n, 0);
+
+  /* report verify latencies with the same code */
+  memcpy(samples, lat, nlat * sizeof(*lat));
+  nsamples = nlat;
+  ops = nlat;
+  for (total_ns = 0, i = 0; i < nlat; i++)
+    total_ns += lat[i];
+  bench_report("verify", "entries", n, 0);
+
+  unlink(otpw_file);
+  free(pw);
+  free(lat);
+}
+
+
+int main(int argc, char **argv)
+{
+  static const size_t md_sizes[] = { 8, 64, 256, 1024, 16384 };
+  static const int sizes[] = { 10, 100, 1000, OTPW_MAXENTRIES };
+  char dir[PATH_MAX];
+  const char *tmp;
+  unsigned i;
+  int c;
+
+  while ((c = getopt(argc, argv, "t:")) != -1)
+    switch (c) {
+    case 't':
+      budget = atof(optarg);
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-t seconds]\n", argv[0]);
+      exit(1);
+    }
+
+  if (md_selftest()) {
+    fprintf(stderr, "md_selftest() failed\n");
+    exit(1);
+  }
+  tmp = getenv("TMPDIR");
+  snprintf(dir, sizeof(dir), "%s/otpw-bench.XXXXXX", tmp ? tmp : "/tmp");
+  if (!mkdtemp(dir) || chdir(dir)) {
+    fprintf(stderr, "Can't create '%s", dir);
+    perror("'");
+    exit(1);
+  }
+
+  printf("{\n  \"md\": \"%s\",\n  \"md_lanes\": %d,\n  \"seconds\": %g,\n"
+	 "  \"results\": [\n", "RIPEMD-160", MD_LANES, budget);
+  for (i = 0; i < sizeof(md_sizes) / sizeof(md_sizes[0]); i++)
+    bench_md(md_sizes[i]);
+  bench_md_batch(16);
+  bench_conv(64, PWCHARS);
+  bench_conv(64, otpw_hlen);
+  bench_conv(32, PWCHARS);
+  bench_conv(32, 16);
+  bench_make_passwd(PW_BASE64, "make_passwd_base64");
+  bench_make_passwd(PW_WORD4, "make_passwd_word4");
+  bench_make_passwd(PW_BASE32, "make_passwd_base32");
+  for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    bench_login(dir, sizes[i]);
+  printf("\n  ]\n}\n");
+
+  rmdir(dir);
+  return 0;
+}
@@ -20,7 +20,19 @@
 #include <assert.h>
 #include <termios.h>
 #include <limits.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <dirent.h>
 #include "otpw.h"
+#include "pwgen.h"
+
+#if defined(__GLIBC__) && \
+  (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 25))
+#define HAVE_GETRANDOM
+#include <sys/random.h>
+#endif
 
 
 #define NL "\r\n"               /* new line sequence in password list output */
@@ -28,7 +40,8 @@
 #define MAX_PASSWORDS 1000                /* maximum length of password list */
 #define MASTERKEY_CHECKBITS 4          /* error-detection bits in master key */
 
-/* shell commands that provide high entropy output for RNG */
+/* shell commands that provide high entropy output for RNG
+ * (only used with option -g or -G, or if there is no kernel RNG) */
 char *entropy_cmds[] = {
   "head -c 20 /dev/urandom 2>&1",
   "ls -lu /etc/. /tmp/. / /usr/. /bin/. /usr/bin/.",
@@ -50,220 +63,6 @@ int emin=30;
 /* suffix added to temporary OTPW file */
 char *tmpsuffix  = ".tmp";
 
-/*
- * A list of common English four letter words. It has not been checked
- * particularly well for being free of rude words or trademarks; users
- * are meant to keep them secret anyway.
- */
-
-char word[2048][4] = {
-  "abel","able","ably","acer","aces","acet","ache","acid","acne","acre",
-  "acts","adam","adds","aden","afar","aged","ages","aide","aids","aims",
-  "airs","airy","ajar","akin","alan","alas","alec","ales","alex","alix",
-  "ally","alma","alps","also","alto","amen","ames","amid","amis","amos",
-  "amps","anal","andy","anew","ange","angy","anna","anne","ante","anti",
-  "ants","anus","anya","aoun","apes","apex","apse","arab","arch","arcs",
-  "ards","area","aria","arid","arms","army","arts","asda","asia","asks",
-  "atom","atop","audi","aung","aunt","aura","auto","avid","aviv","avon",
-  "away","awry","axed","axes","axis","axle","aziz","baba","babe","baby",
-  "bach","back","bade","bags","bail","bait","bake","baku","bald","bale",
-  "bali","ball","balm","band","bang","bank","bans","bare","bark","barn",
-  "barr","bars","bart","base","bash","bass","bath","bats","bays","bcci",
-  "bdda","bead","beak","beam","bean","bear","beat","beck","bede","beds",
-  "beef","been","beep","beer","bees","begs","bell","belt","bend","benn",
-  "bent","berg","bert","best","beta","beth","bets","bias","bids","biff",
-  "bike","bile","bill","bind","bins","bird","birk","birt","bite","bits",
-  "blah","blew","blip","blob","bloc","blot","blow","blue","blur","boar",
-  "boat","bodo","body","boer","bogs","boil","bold","bolt","bomb","bond",
-  "bone","bonn","bono","bony","book","boom","boon","boot","bore","borg",
-  "born","boro","boss","both","bout","bowe","bowl","bows","boyd","boys",
-  "brad","bran","bras","brat","bray","bred","brew","brim","brom","bros",
-  "brow","buck","buds","buff","bugs","bulb","bulk","bull","bump","bums",
-  "bunk","buns","buoy","burn","burr","burt","bury","bush","bust","busy",
-  "butt","buys","buzz","byre","byte","cabs","cafe","cage","cain","cake",
-  "calf","call","calm","came","camp","cane","cans","cape","caps","capt",
-  "cara","card","care","carl","caro","carp","carr","cars","cart","casa",
-  "case","cash","cask","cast","cats","cave","cdna","cegb","cell","cent",
-  "cert","chad","chan","chap","chas","chat","chef","chen","cher","chew",
-  "chic","chin","chip","chop","chub","chum","cite","city","clad","clan",
-  "claw","clay","cleo","clio","clip","club","clue","cnaa","cnut","coal",
-  "coat","coax","coca","code","cohn","coil","coin","coke","cola","cold",
-  "cole","coli","colt","coma","comb","come","comp","cone","cons","cook",
-  "cool","cope","cops","copy","cord","core","cork","corn","corp","cose",
-  "cost","cosy","cots","coun","coup","cove","cows","cpre","cpsu","cpus",
-  "crab","crag","crap","cray","creb","crew","crim","crop","crow","crux",
-  "cruz","csce","cuba","cube","cubs","cues","cuff","cult","cunt","cups",
-  "curb","curd","cure","curl","curt","cute","cuts","daak","dada","dads",
-  "daft","dahl","dais","dale","daly","dame","damn","damp","dams","dana",
-  "dane","dank","dare","dark","dart","dash","data","date","dave","davy",
-  "dawn","days","daze","dead","deaf","deal","dean","dear","debt","deck",
-  "deed","deep","deer","deft","defy","dell","demo","deng","dent","deny",
-  "dept","desk","dial","dice","dick","died","dies","diet","digs","dine",
-  "ding","dino","dint","dire","dirk","dirt","disc","dish","disk","dive",
-  "dock","dodd","does","dogs","dole","doll","dome","done","dons","doom",
-  "door","dope","dora","dose","doth","dots","doug","dour","dove","dowd",
-  "down","drab","drag","draw","drew","drip","drop","drug","drum","dual",
-  "duck","duct","duel","dues","duet","duff","duke","dull","duly","duma",
-  "dumb","dump","dune","dung","dunn","dusk","dust","duty","dyer","dyes",
-  "dyke","each","earl","earn","ears","ease","east","easy","eats","echo",
-  "ecsc","eddy","eden","edge","edgy","edie","edit","edna","edta","eels",
-  "efta","egan","eggs","egon","egos","eire","ella","else","emil","emit",
-  "emma","ends","enid","envy","epic","ercp","eric","erik","esau","esrc",
-  "esso","eton","euro","evan","even","ever","evil","ewen","ewes","exam",
-  "exit","exon","expo","eyed","eyes","eyre","ezra","face","fact","fade",
-  "fads","fags","fail","fair","fake","fall","fame","fand","fans","fare",
-  "farm","farr","fast","fate","fats","fawn","faye","fear","feat","feed",
-  "feel","fees","feet","fell","felt","fend","fenn","fens","fern","fete",
-  "feud","fiat","fife","figs","fiji","file","fill","film","find","fine",
-  "finn","fins","fire","firm","fish","fist","fits","five","flag","flak",
-  "flap","flat","flaw","flea","fled","flee","flew","flex","flip","flop",
-  "flow","floy","flue","flux","foal","foam","foci","foes","foil","fold",
-  "folk","fond","font","food","fool","foot","ford","fore","fork","form",
-  "fort","foul","four","fowl","fran","frau","fray","fred","free","fret",
-  "frog","from","ftse","fuel","fuji","full","fund","funk","furs","fury",
-  "fuse","fuss","fyfe","gael","gail","gain","gait","gala","gale","gall",
-  "game","gang","gaol","gaps","garb","gary","gash","gasp","gate","gatt",
-  "gaul","gave","gays","gaza","gaze","gcse","gear","gels","gems","gene",
-  "gens","gent","germ","gets","gift","gigs","gill","gilt","gina","girl",
-  "gist","give","glad","glee","glen","glow","glue","glum","goal","goat",
-  "gods","goes","goff","gogh","gold","golf","gone","good","gore","gory",
-  "gosh","gown","grab","graf","gram","gran","gray","greg","grew","grey",
-  "grid","grim","grin","grip","grit","grow","grub","guil","gulf","gull",
-  "gulp","gums","gunn","guns","guru","gust","guts","guys","gwen","hack",
-  "haig","hail","hair","hale","half","hall","halo","halt","hams","hand",
-  "hang","hank","hans","hard","hare","hari","harm","harp","hart","hash",
-  "hate","hath","hats","hatt","haul","have","hawk","haze","hazy","head",
-  "heal","heap","hear","heat","heck","heed","heel","heir","hela","held",
-  "hell","helm","help","hens","herb","herd","here","hero","herr","hers",
-  "hess","hibs","hick","hide","high","hike","hill","hilt","hind","hint",
-  "hips","hire","hiss","hits","hive","hiya","hmso","hoax","hogg","hold",
-  "hole","holt","holy","home","hong","hons","hood","hoof","hook","hoop",
-  "hope","hops","horn","hose","host","hour","hove","howe","howl","hrun",
-  "hues","huge","hugh","hugo","hulk","hull","hume","hump","hung","hunt",
-  "hurd","hurt","hush","huts","hyde","hype","iaea","iago","iain","ibid",
-  "iboa","iced","icon","idea","idle","idly","idol","igor","ills","inca",
-  "ince","inch","info","inns","insp","into","iona","ions","iowa","iran",
-  "iraq","iris","iron","isis","isle","itch","item","ivan","ives","ivor",
-  "jack","jade","jail","jake","jams","jane","jars","java","jaws","jazz",
-  "jean","jeep","jeff","jerk","jess","jest","jets","jett","jews","jill",
-  "jimi","joan","jobs","jock","joel","joey","john","join","joke","jolt",
-  "jose","josh","joys","juan","judd","jude","judi","judo","judy","jugs",
-  "july","jump","june","jung","junk","jury","just","kahn","kane","kant",
-  "karl","karr","kate","kath","katy","katz","kaye","keel","keen","keep",
-  "kemp","kent","kept","kerb","kerr","keys","khan","kick","kidd","kids",
-  "kiev","kiff","kill","kiln","kilo","kilt","kind","king","kirk","kiss",
-  "kite","kits","kiwi","knee","knew","knit","knob","knot","know","knox",
-  "koch","kohl","kong","kuhn","kurt","kyle","kyte","labs","lace","lack",
-  "lacy","lads","lady","laid","lain","lair","lais","lake","lama","lamb",
-  "lame","lamp","land","lane","lang","laos","laps","lard","lark","lass",
-  "last","late","lava","lawn","laws","lays","lazy","lead","leaf","leak",
-  "lean","leap","lear","leas","lech","lees","left","legs","lend","lens",
-  "lent","leon","less","lest","lets","levi","levy","leys","liam","liar",
-  "lice","lick","lids","lied","lien","lies","life","lift","like","lili",
-  "lily","lima","limb","lime","limp","lina","line","ling","link","lino",
-  "lion","lips","lira","lire","lisa","list","live","liza","load","loaf",
-  "loan","lobe","loch","lock","loco","loft","logo","logs","lois","lone",
-  "long","look","loom","loop","loos","loot","lord","lore","lori","lose",
-  "loss","lost","lots","loud","love","lowe","ltte","luce","luch","luck",
-  "lucy","ludo","luis","luke","lull","lump","lung","lure","lush","lust",
-  "lute","lyle","lyon","mabs","mace","mach","mack","made","maid","mail",
-  "main","mait","make","mala","male","mali","mall","malt","mama","mane",
-  "mann","mans","manx","many","maps","marc","mare","mark","marr","mars",
-  "marx","mary","mash","mask","mass","mast","mate","mats","matt","maud",
-  "mayo","maze","mead","meal","mean","meat","meek","meet","mega","melt",
-  "memo","mend","mens","menu","mere","mesh","mess","mice","mick","midi",
-  "mike","mild","mile","milk","mill","mime","mind","mine","minh","mini",
-  "mink","mins","mint","mips","mira","mire","miss","mist","mite","moan",
-  "moat","mobs","moby","mock","mode","modi","mold","mole","mona","monk",
-  "mono","mont","mood","moon","moor","moot","more","mori","moss","most",
-  "moth","mott","move","mrna","much","muck","mugs","muir","mule","mull",
-  "mums","muon","muse","must","mute","myra","nacl","naff","nail","name",
-  "nana","nape","nasa","nash","nato","nave","navy","neal","near","neat",
-  "neck","need","neil","nell","neon","nero","ness","nest","nets","news",
-  "next","nice","nick","niki","nile","nina","nine","niro","noah","node",
-  "nods","noel","noir","nome","nona","none","noon","nope","nora","norm",
-  "nose","note","noun","nova","nowt","nude","null","numb","nunn","nuns",
-  "nupe","nuts","oaks","oars","oath","oats","oban","obey","oboe","odds",
-  "oecd","offa","ohio","ohms","oils","oily","okay","olds","olga","oman",
-  "omar","omen","omit","once","ones","only","onto","onus","oops","opal",
-  "opcs","opec","open","oral","orcs","ores","orgy","oslo","otto","ould",
-  "ours","oust","outs","oval","oven","over","owed","owen","owes","owls",
-  "owns","oxen","pace","pack","pact","pads","page","pahl","paid","pain",
-  "pair","pale","pall","palm","pals","pane","pang","pans","papa","para",
-  "park","parr","part","pass","past","pate","path","paul","pave","pawn",
-  "paws","pays","peak","pear","peas","peat","peck","peel","peer","pegs",
-  "peng","penh","penn","pens","pepe","perm","pers","pert","peru","pest",
-  "pete","pets","pews","phew","phil","pick","pied","pier","pies","pigs",
-  "pike","pile","pill","pine","ping","pink","pins","pint","pipe","pips",
-  "pisa","piss","pits","pitt","pity","pius","plan","play","plea","plot",
-  "ploy","plug","plum","plus","pods","poem","poet","poke","pole","poll",
-  "polo","poly","pomp","pond","pons","pont","pony","pooh","pool","poor",
-  "pope","pops","pore","pork","porn","port","pose","posh","posi","post",
-  "pots","pour","pram","prat","pray","prep","pres","prey","prim","prix",
-  "prof","prop","pros","prow","pubs","puff","pugh","pull","pulp","pump",
-  "punk","punt","puny","pups","pure","push","puts","putt","quay","quid",
-  "quit","quiz","race","rack","racy","raft","rage","rags","raid","rail",
-  "rain","rake","ramp","rams","rang","rank","rape","rapt","rare","rash",
-  "rate","rats","rave","rays","rbge","rdbi","read","real","reap","rear",
-  "reds","reed","reef","reel","rees","refs","reid","rein","rely","rene",
-  "rent","reps","rest","retd","revd","revs","reza","rhee","riba","ribs",
-  "rica","rice","rich","rick","rico","ride","rife","rift","riga","rigs",
-  "rind","ring","rink","riot","ripe","risc","rise","risk","rita","rite",
-  "ritz","riva","rnli","road","roam","roar","robb","robe","rock","rode",
-  "rods","role","rolf","roll","roma","rome","roof","rook","room","root",
-  "rope","rory","rosa","rose","ross","rosy","rota","roth","rout","rowe",
-  "rows","rubs","ruby","ruck","rudd","rude","rugs","ruin","rule","rump",
-  "rune","rung","runs","ruse","rush","russ","rust","ruth","ryan","sack",
-  "safe","saga","sage","said","sail","sake","sale","salt","same","sand",
-  "sane","sang","sank","sans","sara","sash","saul","save","saws","says",
-  "sbus","scan","scar","scot","scsi","scum","seal","seam","sean","seas",
-  "seat","secs","sect","seed","seek","seem","seen","seep","sees","sega",
-  "sejm","self","sell","sema","semi","send","sent","sept","sera","serb",
-  "serc","seth","sets","seve","sewn","sexy","shae","shah","shai","sham",
-  "shaw","shed","shia","shih","shin","ship","shoe","shop","shot","show",
-  "shut","sick","side","sigh","sign","sikh","silk","sill","silt","sims",
-  "sine","sing","sink","sins","site","sits","size","skin","skip","skis",
-  "skye","slab","slag","slam","slap","slid","slim","slip","slit","slot",
-  "slow","slug","slum","slur","slut","smog","smug","snag","snap","snip",
-  "snob","snow","snub","snug","soak","soap","soar","sobs","sock","soda",
-  "sofa","soft","soho","soil","sold","sole","solo","some","song","sons",
-  "sony","soon","soot","sore","sort","soul","soup","sour","sown","sows",
-  "soya","span","spar","spat","spec","sped","spin","spit","spot","spun",
-  "spur","ssap","stab","stag","stan","star","stay","stem","step","stew",
-  "stir","stok","stop","stow","stub","stud","subs","such","suck","sued",
-  "suez","suit","sums","sung","sunk","suns","supt","sure","surf","suzi",
-  "suzy","swam","swan","swap","sway","swig","swim","tabs","tack","tact",
-  "taff","tags","tail","tait","take","tale","talk","tall","tame","tang",
-  "tank","tape","taps","tara","tart","task","tate","taut","taxi","teak",
-  "teal","team","tear","teas","tech","tecs","teen","tees","tell","tend",
-  "tens","tent","term","tess","test","text","thai","than","that","thaw",
-  "thee","them","then","theo","they","thin","this","thou","thud","thug",
-  "thus","tick","tide","tidy","tied","tier","ties","tile","till","tilt",
-  "time","tina","tins","tiny","tips","tire","tito","toad","toby","todd",
-  "toes","togo","toil","told","toll","tomb","tome","tone","toni","tons",
-  "tony","took","tool","tops","tore","torn","tort","tory","toss","tour",
-  "town","toys","tram","trap","tray","tree","trek","trim","trio","trip",
-  "trna","trod","trot","troy","true","tsar","tube","tubs","tuck","tuna",
-  "tune","tung","turf","turk","turn","tvei","twig","twin","twit","twos",
-  "tyne","type","tyre","ucta","uefa","ugly","uist","undo","unit","unix",
-  "unto","upon","urea","urge","urgh","used","user","uses","ussr","utah",
-  "vain","vale","vane","vans","vary","vase","vass","vast","vats","veal",
-  "veil","vein","vent","vera","verb","vern","very","vest","veto","vets",
-  "vial","vibe","vice","view","vile","vine","visa","vita","vivo","void",
-  "vole","volt","vote","vous","vows","wabi","wacc","wade","wage","wail",
-  "wait","wake","walk","wall","walt","wand","wang","want","ward","ware",
-  "warm","warn","warp","wars","wary","wash","wasp","watt","wave","wavy",
-  "ways","weak","wear","webb","webs","weed","week","weep","weir","well",
-  "went","wept","were","west","what","when","whig","whim","whip","whit",
-  "whoa","whom","wick","wide","wife","wigs","wild","will","wily","wind",
-  "wine","wing","wink","wins","wipe","wire","wiry","wise","wish","with",
-  "wits","woes","woke","wolf","womb","wont","wood","wool","word","wore",
-  "work","worm","worn","wove","wrap","wren","writ","wyre","yale","yang",
-  "yard","yarn","yawn","yeah","year","yell","yoga","yoke","yolk","york",
-  "your","yous","yuan","yuri","yves","zach","zack","zapt","zeal","zero",
-  "zest","zeta","zeus","zinc","zone","zoom","zoos","zzap"
-};
-
 int debug = 0;
 
 
@@ -300,15 +99,137 @@ void gurgle(md_state *mdp, char *command)
 }
 
 
+/* Run all entropy_cmds concurrently and add to message digest
+ * whatever output they produce within timeout milliseconds. Commands
+ * still running after that (e.g., "last" reading a huge wtmp file)
+ * are killed, along with their process group. */
+
+void gurgle_parallel(md_state *mdp, int timeout)
+{
+  enum { N = sizeof(entropy_cmds)/sizeof(char*) };
+  struct pollfd pfd[N];
+  pid_t pid[N];
+  long len[N], l;
+  int p[2], open_cmds = 0, ms;
+  unsigned i;
+  char buf[128];
+  struct timeval t, deadline;
+
+  gettimeofday(&deadline, NULL);
+  md_add(mdp, &deadline, sizeof(deadline));
+  deadline.tv_sec  += timeout / 1000;
+  deadline.tv_usec += (timeout % 1000) * 1000;
+  for (i = 0; i < N; i++) {
+    pfd[i].fd = -1;
+    pfd[i].events = POLLIN;
+    len[i] = 0;
+    pid[i] = -1;
+    if (pipe(p)) {
+      perror("pipe");
+      continue;
+    }
+    pid[i] = fork();
+    if (pid[i] == 0) {
+      /* child: run command in its own process group */
+      setpgid(0, 0);
+      close(p[0]);
+      dup2(p[1], 1);
+      close(p[1]);
+      execl("/bin/sh", "sh", "-c", entropy_cmds[i], (char *) NULL);
+      _exit(127);
+    }
+    close(p[1]);
+    if (pid[i] < 0) {
+      fprintf(stderr, "External entropy source command '%s'\n"
+	      "(one of several) failed.\n", entropy_cmds[i]);
+      close(p[0]);
+      continue;
+    }
+    pfd[i].fd = p[0];
+    open_cmds++;
+  }
+
+  while (open_cmds > 0) {
+    gettimeofday(&t, NULL);
+    ms = (deadline.tv_sec - t.tv_sec) * 1000 +
+      (deadline.tv_usec - t.tv_usec) / 1000;
+    if (ms <= 0 || poll(pfd, N, ms) <= 0)
+      break;
+    for (i = 0; i < N; i++) {
+      if (pfd[i].fd < 0 || !pfd[i].revents)
+	continue;
+      l = read(pfd[i].fd, buf, sizeof(buf));
+      if (l > 0) {
+	md_add(mdp, &i, sizeof(i));
+	md_add(mdp, buf, l);
+	len[i] += l;
+      } else {
+	close(pfd[i].fd);
+	pfd[i].fd = -1;
+	open_cmds--;
+      }
+    }
+  }
+
+  for (i = 0; i < N; i++) {
+    if (pfd[i].fd >= 0) {
+      fprintf(stderr, "External entropy source command '%s'\n"
+	      "timed out after %d ms.\n", entropy_cmds[i], timeout);
+      close(pfd[i].fd);
+      kill(-pid[i], SIGKILL);
+      kill(pid[i], SIGKILL);
+    }
+    if (pid[i] > 0)
+      waitpid(pid[i], NULL, 0);
+    if (debug)
+      fprintf(stderr, "'%s' added %ld bytes.\n", entropy_cmds[i], len[i]);
+  }
+  gettimeofday(&t, NULL);
+  md_add(mdp, &t, sizeof(t));
+}
+
+
+/* Read len bytes from the kernel random number generator, returns
+ * 0 on success or -1 if there is no such generator */
+
+int kernel_random(void *buf, size_t len)
+{
+  int fd;
+  ssize_t l;
+
+#ifdef HAVE_GETRANDOM
+  if (getrandom(buf, len, 0) == (ssize_t) len)
+    return 0;
+#endif
+  fd = open("/dev/urandom", O_RDONLY);
+  if (fd < 0)
+    return -1;
+  l = read(fd, buf, len);
+  close(fd);
+  return l == (ssize_t) len ? 0 : -1;
+}
+
+
 /* A random bit generator. Hashes together various sources of entropy
  * to provide a 16 byte high quality random seed */
 
+/* Sources of entropy used for seeding the random bit generator:
+ *
+ *   0: kernel random number generator only (default)
+ *   1: in addition, the output of entropy_cmds, one after another
+ *   2: in addition, the output of entropy_cmds, run concurrently
+ *      for at most gather_timeout milliseconds */
+
+int gather = 0;
+int gather_timeout = 2000;
+
 /* Determine the initial start state of the random bit generator */
 
 void rbg_seed(unsigned char *r)
 {
   unsigned i;
   md_state md;
+  unsigned char rbs[2 * MD_LEN];
   struct {
     clock_t clk;
     pid_t pid;
@@ -318,11 +239,26 @@ void rbg_seed(unsigned char *r)
   
   md_init(&md);
 
+  /* read out kernel random number generator */
+  if (kernel_random(rbs, sizeof(rbs)) == 0) {
+    md_add(&md, rbs, sizeof(rbs));
+    memset(rbs, 0, sizeof(rbs));
+  } else if (!gather) {
+    fprintf(stderr, "No kernel random number generator available, "
+	    "using external entropy source commands.\n");
+    gather = 1;
+  }
+
   /* get entropy via some shell commands */
-  for (i = 0;  i < sizeof(entropy_env)/sizeof(char*); i++)
-    putenv(entropy_env[i]);
-  for (i = 0; i < sizeof(entropy_cmds)/sizeof(char*); i++)
-    gurgle(&md, entropy_cmds[i]);
+  if (gather) {
+    for (i = 0;  i < sizeof(entropy_env)/sizeof(char*); i++)
+      putenv(entropy_env[i]);
+    if (gather == 2)
+      gurgle_parallel(&md, gather_timeout);
+    else
+      for (i = 0; i < sizeof(entropy_cmds)/sizeof(char*); i++)
+	gurgle(&md, entropy_cmds[i]);
+  }
 
   /* other minor sources of entropy */
   entropy.clk = clock();
@@ -354,16 +290,60 @@ void rbg_iter(unsigned char *r)
 
 
 /* Generate a random byte string s with len bytes from a
- * seed string seed with length slen */
+ * seed string seed with length slen, using one of two methods:
+ *
+ *   1: hash counter, previous result and seed for each output
+ *      byte, but keep only the first byte of each hash value
+ *      (used by version 1.5 and earlier)
+ *   2: counter mode, i.e. output the concatenation of the hash
+ *      values of counter and seed, one per MD_LEN bytes of output
+ *
+ * Only method 1 recreates the password lists of master keys
+ * generated before version 1.6 (option -k), therefore the method is
+ * recorded in each master key, see masterkey_expansion(). */
+
+int expansion = 2;
 
 void random_string(const void *seed, size_t slen, void *s, size_t len)
 {
   md_state md;
-  unsigned char r[MD_LEN];
-  size_t i;
+  unsigned char r[MD_LEN], *blk;
+  unsigned char rb[MD_LANES * MD_LEN];
+  const void *src[MD_LANES];
+  size_t srclen[MD_LANES];
+  size_t i, b, chunk;
+  int l, lanes;
   char j;
 
   assert(len <= 0xffffffff);
+  if (expansion == 2) {
+    /* hash up to MD_LANES blocks (counter + seed) at a time */
+    blk = malloc(MD_LANES * (4 + slen));
+    if (!blk) abort();
+    for (b = 0; b * MD_LEN < len; b += lanes) {
+      lanes = 0;
+      while (lanes < MD_LANES && (b + lanes) * MD_LEN < len) {
+	src[lanes] = blk + lanes * (4 + slen);
+	srclen[lanes] = 4 + slen;
+	blk[lanes * (4 + slen) + 0] = (b + lanes) >> 24;
+	blk[lanes * (4 + slen) + 1] = (b + lanes) >> 16;
+	blk[lanes * (4 + slen) + 2] = (b + lanes) >> 8;
+	blk[lanes * (4 + slen) + 3] = (b + lanes);
+	memcpy(blk + lanes * (4 + slen) + 4, seed, slen);
+	lanes++;
+      }
+      md_batch(NULL, lanes, src, srclen, rb);
+      for (l = 0; l < lanes; l++) {
+	i = (b + l) * MD_LEN;
+	chunk = len - i < MD_LEN ? len - i : MD_LEN;
+	memcpy((unsigned char *)s + i, rb + l * MD_LEN, chunk);
+      }
+    }
+    memset(blk, 0, MD_LANES * (4 + slen));
+    memset(rb, 0, sizeof(rb));
+    free(blk);
+    return;
+  }
   md_init(&md);
   md_add(&md, seed, slen);
   md_close(&md, r);
@@ -381,202 +361,20 @@ void random_string(const void *seed, size_t slen, void *s, size_t len)
 }
 
 
-/*
- * Transform the first 6*chars bits of the binary string v into a chars
- * character long string s. The encoding is a modification of the MIME
- * base64 encoding where characters with easily confused glyphs are
- * avoided (0 vs O, 1 vs. l vs. I).
- */
-
-void conv_base64(char *s, const unsigned char *v, int chars)
-{
-  static const char tab[] =
-    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijk%mnopqrstuvwxyz"
-    ":=23456789+/";
-  int i, j;
-  
-  for (i = 0; i < chars; i++) {
-    j = (i / 4) * 3;
-    switch (i % 4) {
-    case 0: *s++ = tab[  v[j]  >>2];                        break;
-    case 1: *s++ = tab[((v[j]  <<4) & 0x30) | (v[j+1]>>4)]; break;
-    case 2: *s++ = tab[((v[j+1]<<2) & 0x3c) | (v[j+2]>>6)]; break;
-    case 3: *s++ = tab[  v[j+2]     & 0x3f];                break;
-    }
-  }
-  *s++ = '\0';
-}
-
-
-/*
- * Transform the first 5*chars bits of the binary string v into a chars
- * character long string s. The encoding uses only lowercase letters
- * and digit, in order to make it easy to communicate by voice (e.g.,
- * using the NATO alphabet).
- */
+/* The first MASTERKEY_CHECKBITS bits of the hash value h of a
+ * (normalized) master key tell the expansion method that it is used
+ * with: 0 for method 1 (as in all keys before version 1.6), 1 for
+ * method 2. Returns the method, or -1 for an invalid key. */
 
-void conv_base32(char *s, const unsigned char *v, int chars)
+int masterkey_expansion(const unsigned char *h)
 {
-  static const char tab[] =
-    "abcdefghijkmnpqrstuvwxyz23456789";
-  int i, j = 0, k = 0;
-  
-  for (i = 0; i < chars; i++) {
-    if (k < 5) {
-      j = j << 8 | *(v++);
-      k += 8;
-    }
-    *s++ = tab[(j >> (k-5)) & 31];
-    k -= 5;
+  switch (h[0] >> (8 - MASTERKEY_CHECKBITS)) {
+  case 0:
+    return 1;
+  case 1:
+    return 2;
   }
-  *s++ = '\0';
-}
-
-
-/*
- * Normalize a password by removing whitespace etc. and converting
- * l1| -> I, 0 -> O, \ -> /, just like otpw_verify() does.
- */
-void pwnorm(char *password) {
-  char *src, *dst;
-  
-  src = dst = password;
-  while (1) {
-    if (*src == 'l' || *src == '1' || *src == '|')
-      *dst++ = 'I';
-    else if (*src == '0')
-      *dst++ = 'O';
-    else if (*src == '\\')
-      *dst++ = '/';
-    else if ((*src >= 'A' && *src <= 'Z') ||
-	     (*src >= 'a' && *src <= 'z') ||
-	     (*src >= '2' && *src <= '9') ||
-	     *src == ':' ||
-	     *src == '%' ||
-	     *src == '=' ||
-	     *src == '+' ||
-	     *src == '/')
-      *dst++ = *src;
-    else if (*src == '\0') {
-      *dst++ = *src;
-      return;
-    }
-    src++;
-  }
-}
-
-
-#define PW_BASE64  0
-#define PW_WORD4   1
-#define PW_BASE32  2
-
-/*
- * Convert a random bit sequence into a printable password
- *
- * Input:      vr        random bit string
- *             vlen      length of vr in bytes
- *             type      0: modified base-64 encoding
- *                       1: sequence of 4-letter words
- *                       2: base-32 encoding (lowercase plus digits)
- *             entropy   requested minimum entropy of password
- *             buf       buffer for returning zero-terminated output password
- *             buflen    length of buffer in bytes
- *
- * Returns negative value if provided combination of vlen, type,
- * ent and buflen are not adequate, otherwise return length of
- * generated password (excluding terminating '\0').
- *
- * If buf == NULL, return value depends on buflen:
- *
- *  0:  length of password that would have been generated
- *  1:  number of its non-space password characters
- *  2:  actually used entropy if buflen == 2
- *  3:  maximum entropy that can be specified for given vlen
- */
-int make_passwd(const void *vr, int vlen, int type, int entropy,
-		char *buf, int buflen)
-{
-  int pwchars;   /* number of characters in password */
-  int pwlen;     /* length of password, including whitespace */
-  int emax;
-  int i, j, k;
-  const unsigned char *v = vr;
-
-  /* calculate length of output and actually used entropy */
-  switch (type) {
-  case PW_BASE32:
-    pwchars = (entropy + 4) / 5;
-    entropy = pwchars * 5;
-    pwlen = pwchars + (pwchars > 5 ? (pwchars - 1) / 4 : 0);
-    emax = ((vlen * 8) / 5) * 5;
-    break;
-  case PW_BASE64:
-    pwchars = (entropy + 5) / 6;
-    entropy = pwchars * 6;
-    pwlen = pwchars + (pwchars > 5 ? (pwchars - 1) / 4 : 0);
-    emax = ((vlen * 8) / 6) * 6;
-    break;
-  case PW_WORD4:
-    pwchars = 4 * ((entropy + 10) / 11);
-    entropy = 11 * ((entropy + 10) / 11);
-    pwlen = pwchars + pwchars / 4 - (pwchars > 0);
-    emax = ((vlen * 8) / 11) * 11;
-    break;
-  default:
-    return -1;
-  }
-
-  if (!buf) {
-    switch (buflen) {
-    case 0: return pwlen;      /* including spaces */
-    case 1: return pwchars;    /* excluding spaces */
-    case 2: return entropy;
-    case 3: return emax;
-    default: return -2;
-    }
-  }
-  if (entropy > vlen * 8)
-    return -3;
-  if (pwlen >= buflen)
-    return -4;
-
-  switch (type) {
-  case PW_BASE32:
-  case PW_BASE64:
-    if (type == PW_BASE32)
-      conv_base32(buf, v, pwchars);
-    else
-      conv_base64(buf, v, pwchars);
-    /* add spaces every 3-4 chars for readability (Bresenham's algorithm) */
-    i = pwchars - 1;
-    j = pwlen - 1;
-    k = (pwlen - pwchars) / 2;
-    while (i >= 0 && j >= 0) {
-      buf[j--] = buf[i--];
-      if ((k += pwlen - pwchars + 1) >= pwchars && j > 0) {
-	buf[j--] = ' ';
-	k -= pwchars;
-      }
-    }
-    buf[pwlen] = '\0';
-    break;
-  case PW_WORD4:
-    for (i = 0; i < pwchars/4; i++) {
-      k = 0;
-      for (j = i * 11; j < (i+1) * 11; j++)
-	k = (k << 1) | ((v[j / 8] >> (j % 8)) & 1);
-      memcpy(buf + i * 5, word[k], 4);
-      buf[i * 5 + 4] = ' ';
-    }
-    buf[i * 5 - 1] = '\0';
-    break;
-  default:
-    return -1;
-  }
-
-  assert((int) strlen(buf) == pwlen);
-
-  return pwlen;
+  return -1;
 }
 
 
@@ -601,14 +399,23 @@ int main(int argc, char **argv)
   int header_lines = 4, random_order = 1;
   int entropy = 48, emax, type = PW_BASE64;
   int key_entropy = 76, key_type = PW_BASE32;
-  int use_masterkey = 0, regenerate = 0, unlock = 0;
+  int use_masterkey = 0, regenerate = 0, unlock = 0, xopt = 0;
   int cols;
   time_t t;
   char *hbuf, *rndbuf;
   int rndbuflen;
+  char *pwq, *chq = NULL;      /* queued normalized passwords, challenges */
+  const void **qsrc;
+  size_t *qlen;
+  unsigned char *qh, *seeds = NULL;
   int challen = 3;    /* number of characters in challenge */
   int hbuflen = challen + otpw_hlen + 1;
   int help = 0;
+  int format = 2, n;
+  struct otpw2_header h2;
+  unsigned char header2[OTPW2_HDRLEN];
+  DIR *dir;
+  struct dirent *de;
 
   assert(md_selftest() == 0);
   assert(otpw_hlen * 6 < MD_LEN * 8);
@@ -716,6 +523,25 @@ int main(int argc, char **argv)
 	case 'l':
 	  unlock = 1;
 	  break;
+	case '1':
+	  format = 1;
+	  break;
+	case 'g':
+	  gather = 1;
+	  break;
+	case 'G':
+	  if (++i >= argc || (gather_timeout = atoi(argv[i])) < 1)
+	    { help = 1; break; }
+	  gather = 2;
+	  j = -1;
+	  break;
+	case 'x':
+	  if (++i >= argc ||
+	      ((expansion = atoi(argv[i])) != 1 && expansion != 2))
+	    { help = 1; break; }
+	  xopt = expansion;
+	  j = -1;
+	  break;
 	default:
           help = 1;
         }
@@ -783,7 +609,9 @@ int main(int argc, char **argv)
        "  -p 0\t\tpasswords from modified base64 encoding (default)\n"
        "  -p 1\t\tpasswords from English 4-letter words\n"
        "  -p 2\t\tpasswords use only lowercase letters and digits\n"
-       "  -f <filename>\toutput hash file (%s)\n",
+       "  -f <filename>\toutput hash file (%s)\n"
+       "  -1\t\twrite hash file in old text format OTPW1, readable by\n"
+       "\t\tOTPW versions before 1.6 (default: binary format OTPW2)\n",
        fnout);
     fprintf
       (stderr,
@@ -793,12 +621,20 @@ int main(int argc, char **argv)
        "  -E <int>\tminimum entropy of master key [bits] (76)\n"
        "  -P <int>\tencoding for master key (available values as for -p)\n"
        "  -k\t\task for a master key and then regenerate a password\n\t\tlist"
-       " from it (this won't change %s)\n", fnout);
+       " from it (this won't change %s)\n"
+       "  -x <int>\tmethod for expanding random seeds into passwords:\n"
+       "\t\t1 (up to version 1.5) or 2 (default); with -k, the\n"
+       "\t\tmaster key tells the method\n", fnout);
     fprintf
       (stderr,
+       "  -g\t\tseed RNG also from the output of shell commands such as\n"
+       "\t\tps, last and netstat (default: only kernel RNG)\n"
+       "  -G <int>\tlike -g, but run these commands in parallel, for at\n"
+       "\t\tmost the given number of milliseconds\n"
        "  -r\t\tsuggest a random password, then exit\n"
-       "  -l\t\tremove lock file %s%s, then exit\n",
-       fnout, otpw_locksuffix);
+       "  -l\t\tremove lock file %s%s and lock directory %s%s,\n"
+       "\t\tthen exit\n",
+       fnout, otpw_locksuffix, fnout, otpw_lockdirsuffix);
     fprintf
       (stderr,
        "  -d\t\toutput debugging information\n"
@@ -938,10 +774,17 @@ int main(int argc, char **argv)
     md_init(&md);
     md_add(&md, normal_masterkey, strlen(normal_masterkey));
     md_close(&md, h);
-    if (h[0] & (0xff - (1 << (8 - MASTERKEY_CHECKBITS)) + 1)) {
+    if (masterkey_expansion(h) < 0) {
       fprintf(stderr, "\nIncorrect master key (invalid checkbits)!\n");
       exit(1);
     }
+    if (xopt && xopt != masterkey_expansion(h)) {
+      fprintf(stderr, "\nThis master key requires option -x %d!\n",
+	      masterkey_expansion(h));
+      exit(1);
+    }
+    /* recreate the list with the method that the key was made for */
+    expansion = masterkey_expansion(h);
   } else {
     if (strcmp(password1, password2)) {
       fprintf(stderr, "\nThe two entered passwords were not identical!\n");
@@ -970,8 +813,14 @@ int main(int argc, char **argv)
   }
 
   /* allocate buffer for hash values */
-  hbuf = malloc(pages * rows * cols * hbuflen);
-  if (!hbuf) {
+  n = pages * rows * cols;
+  hbuf = malloc(n * hbuflen);
+  /* buffers for hashing many messages at once with md_batch() */
+  pwq = malloc(n * pwchars + 1);
+  qsrc = malloc(n * sizeof(*qsrc));
+  qlen = malloc(n * sizeof(*qlen));
+  qh = malloc(n * MD_LEN);
+  if (!hbuf || !pwq || !qsrc || !qlen || !qh) {
     fprintf(stderr, "Memory allocation error!\n");
     exit(1);
   }
@@ -997,13 +846,33 @@ int main(int argc, char **argv)
       md_init(&md);
       md_add(&md, normal_masterkey, strlen(normal_masterkey));
       md_close(&md, h);
-      /* until its hash has the first MASTERKEY_CHECKBITS zero */
-    } while (h[0] & (0xff - (1 << (8 - MASTERKEY_CHECKBITS)) + 1));
+      /* until the first MASTERKEY_CHECKBITS of its hash tell the
+       * expansion method */
+    } while (masterkey_expansion(h) != expansion);
     fprintf(stderr, "Master key: %s\n"
 	    "(Option -k will recreate the same password list "
 	    "from this key.)\n\n", masterkey);
   }
 
+  if (use_masterkey || regenerate) {
+    /* derive the seeds of all passwords from masterkey and challenge */
+    chq = malloc(n * (challen + 1));
+    seeds = malloc(n * MD_LEN);
+    if (!chq || !seeds) {
+      fprintf(stderr, "Memory allocation error!\n");
+      exit(1);
+    }
+    for (k = 0; k < n; k++) {
+      snprintf(challenge, sizeof(challenge), "%03d", k);
+      qlen[k] = strlen(challenge);
+      assert(qlen[k] <= (size_t) challen);
+      qsrc[k] = memcpy(chq + k * (challen + 1), challenge, qlen[k]);
+    }
+    md_init(&md);
+    md_add(&md, normal_masterkey, strlen(normal_masterkey));
+    md_batch(&md, n, qsrc, qlen, seeds);
+  }
+
   for (l = 0; l < pages; l++) {
     if (header_lines)
       fputs(header, stdout);
@@ -1014,11 +883,7 @@ int main(int argc, char **argv)
 	/* generate new password ... */
 	if (use_masterkey || regenerate) {
 	  /* ... from masterkey and challenge string */
-	  md_init(&md);
-	  md_add(&md, normal_masterkey, strlen(normal_masterkey));
-	  md_add(&md, challenge, strlen(challenge));
-	  md_close(&md, h);
-	  random_string(h, MD_LEN, rndbuf, rndbuflen);
+	  random_string(seeds + k * MD_LEN, MD_LEN, rndbuf, rndbuflen);
 	} else {
 	  /* ... randomly */
 	  rbg_iter(r);
@@ -1030,14 +895,9 @@ int main(int argc, char **argv)
 	if (j < cols - 1)
 	  printf("  ");
 	if (!regenerate) {
-	  /* hash password1 + pwnorm(password) and save result */
-	  md_init(&md);
-	  md_add(&md, password1, strlen(password1));
+	  /* queue pwnorm(password) for hashing */
 	  pwnorm(password);
-	  md_add(&md, password, pwchars);
-	  md_close(&md, h);
-	  sprintf(hbuf + k * hbuflen, "%0*d", challen, k);
-	  conv_base64(hbuf + k*hbuflen + challen, h, otpw_hlen);
+	  memcpy(pwq + k * pwchars, password, pwchars);
 	}
       }
       if (i < rows - 1)
@@ -1053,6 +913,21 @@ int main(int argc, char **argv)
       printf(NL);
   }
 
+  if (!regenerate) {
+    /* hash password1 + pwnorm(password) of all entries and save results */
+    for (k = 0; k < n; k++) {
+      qsrc[k] = pwq + k * pwchars;
+      qlen[k] = pwchars;
+    }
+    md_init(&md);
+    md_add(&md, password1, strlen(password1));
+    md_batch(&md, n, qsrc, qlen, qh);
+    for (k = 0; k < n; k++) {
+      sprintf(hbuf + k * hbuflen, "%0*d", challen, k);
+      conv_base64(hbuf + k*hbuflen + challen, qh + k * MD_LEN, otpw_hlen);
+    }
+  }
+
   /* paranoia RAM scrubbing (note that we can't scrub stdout/stdin portably) */
   rbg_iter(r);
   rbg_iter(r);
@@ -1064,6 +939,10 @@ int main(int argc, char **argv)
   memset(password1, 0xaa, sizeof(password1));
   memset(password2, 0xaa, sizeof(password2));
   memset(password, 0xaa, pwlen);
+  memset(pwq, 0xaa, n * pwchars);
+  memset(qh, 0xaa, n * MD_LEN);
+  if (seeds)
+    memset(seeds, 0xaa, n * MD_LEN);
   fclose(stdout);
 
   if (regenerate)
@@ -1088,23 +967,47 @@ int main(int argc, char **argv)
   }
 
   /* write magic code for format identification */
-  fprintf(f, "%s", otpw_magic);
-  fprintf(f, "%d %d %d %d\n", pages * rows * cols, challen, otpw_hlen,
-	  pwchars);
+  if (format == 2) {
+    h2.entries = n;
+    h2.challen = challen;
+    h2.hlen = otpw_hlen;
+    h2.pwlen = pwchars;
+    h2.remaining = n;
+    h2.next = 0;
+    otpw2_pack_header(header2, &h2);
+    fwrite(header2, 1, OTPW2_HDRLEN, f);
+    /* bitmap of used entries */
+    for (k = 0; k < OTPW2_BITMAPLEN(n); k++)
+      fputc(0, f);
+  } else {
+    fprintf(f, "%s", otpw_magic);
+    fprintf(f, "%d %d %d %d\n", n, challen, otpw_hlen, pwchars);
+  }
   
   /* output all hash values in random permutation order */
   if (random_order) {
-    for (k = pages * rows * cols - 1; k >= 0; k--) {
+    for (k = n - 1; k >= 0; k--) {
       rbg_iter(r);
       i = k > 0 ? (*(unsigned *) r) % k : 0;
-      fprintf(f, "%s\n", hbuf + i*hbuflen);
+      if (format == 2)
+	fwrite(hbuf + i*hbuflen, 1, hbuflen - 1, f);
+      else
+	fprintf(f, "%s\n", hbuf + i*hbuflen);
       memcpy(hbuf + i*hbuflen, hbuf + k*hbuflen, hbuflen);
     }
   } else {
-    for (k = 0; k < pages * rows * cols; k++)
-      fprintf(f, "%s\n", hbuf + k*hbuflen);
+    for (k = 0; k < n; k++)
+      if (format == 2)
+	fwrite(hbuf + k*hbuflen, 1, hbuflen - 1, f);
+      else
+	fprintf(f, "%s\n", hbuf + k*hbuflen);
   }
 
+  if (ferror(f)) {
+    fprintf(stderr, "Can't write to '%s", fntmp);
+    perror("'");
+    exit(1);
+  }
   fclose(f);
   if (rename(fntmp, fnout)) {
     fprintf(stderr, "Can't rename '%s' to '%s", fntmp, fnout);
@@ -1129,6 +1032,28 @@ int main(int argc, char **argv)
     fprintf(stderr, "Deleted lock file '%s'\n", fntmp);
   }
   free(fntmp);
+
+  /* ... as are the per-entry locks in the lock directory */
+  fntmp = (char *) malloc(strlen(fnout)+strlen(otpw_lockdirsuffix)+1);
+  if (!fntmp) abort();
+  strcpy(fntmp, fnout);
+  strcat(fntmp, otpw_lockdirsuffix);
+  if ((dir = opendir(fntmp))) {
+    while ((de = readdir(dir)))
+      if (strcmp(de->d_name, ".") && strcmp(de->d_name, ".."))
+	unlinkat(dirfd(dir), de->d_name, 0);
+    closedir(dir);
+  }
+  if (rmdir(fntmp)) {
+    if (errno != ENOENT) {
+      fprintf(stderr, "Can't delete lock directory '%s", fntmp);
+      perror("'");
+      exit(1);
+    }
+  } else {
+    fprintf(stderr, "Deleted lock directory '%s'\n", fntmp);
+  }
+  free(fntmp);
   
   return 0;
 }
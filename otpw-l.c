@@ -9,7 +9,9 @@
  * Markus Kuhn <http://www.cl.cam.ac.uk/~mgk25/>
  */
 
-
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE  /* for F_OFD_SETLK in otpw.c */
+#endif
 #include <syslog.h>
 
 
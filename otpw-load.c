@@ -0,0 +1,415 @@
+/*
+ * Load generator for the OTPW login library
+ *
+ *   otpw-load -g [-u users] [-n entries] dir
+ *
+ * creates the home directories dir/000000, dir/000001, ... of the
+ * given number of test users, each with an OTPW2 file .otpw with the
+ * given number of entries and known passwords.
+ *
+ *   otpw-load [-u users] [-j workers] [-P] [-t seconds] [-c contention]
+ *             [-a abort] [-w usec] [-L lock] dir
+ *
+ * then lets the workers (threads, or processes with -P) log in one
+ * after another with otpw_prepare() and otpw_verify() as randomly
+ * chosen users, where a fraction contention of all logins goes to
+ * user 0, and a fraction abort of all challenges is abandoned instead
+ * of answered. Option -w adds a delay between challenge and response,
+ * while which the entry stays locked, and -L selects the locking
+ * method (symlink, entry, ofd or none). The hash files are used up
+ * as the run goes on, so a long run also shows what happens as the
+ * lists are depleted. At the end, the counters and latency histograms
+ * are printed as "name value" lines, like those of otpwd -q.
+ *
+ * Markus Kuhn <http://www.cl.cam.ac.uk/~mgk25/>
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include "otpw.h"
+#include "md.h"
+#include "pwgen.h"
+
+#define PWCHARS  8        /* characters per password */
+#define PREFIX   "prefix password"
+#define HBUCKETS 32       /* latency histogram buckets, powers of two */
+
+enum { H_PREPARE, H_VERIFY, H_LOGIN, H_COUNT };
+static const char *hname[H_COUNT] = { "prepare", "verify", "login" };
+
+/* counters of one worker (in shared memory, also with option -P) */
+struct stats {
+  unsigned long logins;       /* calls of otpw_prepare() */
+  unsigned long single;       /* challenges for one password */
+  unsigned long multi;        /* multi challenges */
+  unsigned long blocked;      /* no challenge, although entries remain */
+  unsigned long depleted;     /* no challenge, no entries (or file) left */
+  unsigned long aborted;      /* challenges abandoned */
+  unsigned long ok, wrong, error;  /* results of otpw_verify() */
+  unsigned long reused;       /* accepted passwords accepted before */
+  unsigned long hist[H_COUNT][HBUCKETS];  /* latencies [us], log2 */
+};
+
+static const char *dir;
+static int users = 100, entries = 100;
+static double seconds = 10, contention = 0, abort_rate = 0;
+static int think = 0, flags = 0;
+static struct stats *stats;    /* one per worker */
+static unsigned char *used;    /* per user, bitmap of accepted entries */
+static double deadline;
+
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void hist_add(unsigned long *h, double secs)
+{
+  unsigned long us = secs * 1e6;
+  int b = 0;
+
+  while (us > 1 && b < HBUCKETS - 1) {
+    us >>= 1;
+    b++;
+  }
+  h[b]++;
+}
+
+/* the known password of entry k of user u */
+static void password_of(char *pw, int u, int k)
+{
+  md_state md;
+  unsigned char v[MD_LEN];
+
+  md_init(&md);
+  md_add(&md, &u, sizeof(u));
+  md_add(&md, &k, sizeof(k));
+  md_close(&md, v);
+  conv_base64(pw, v, PWCHARS);
+}
+
+
+/* write the OTPW2 file of user u */
+static int generate(int u)
+{
+  md_state md;
+  char path[PATH_MAX], *pw, entry[81];
+  const void **src;
+  size_t *len;
+  unsigned char *h, header[OTPW2_HDRLEN];
+  struct otpw2_header hdr;
+  FILE *f;
+  int k, challen;
+
+  challen = entries > 1000 ? 4 : 3;
+  pw = malloc(entries * (PWCHARS + 1));
+  src = malloc(entries * sizeof(*src));
+  len = malloc(entries * sizeof(*len));
+  h = malloc(entries * MD_LEN);
+  if (!pw || !src || !len || !h) abort();
+  for (k = 0; k < entries; k++) {
+    password_of(pw + k * (PWCHARS + 1), u, k);
+    src[k] = pw + k * (PWCHARS + 1);
+    len[k] = PWCHARS;
+  }
+  md_init(&md);
+  md_add(&md, PREFIX, strlen(PREFIX));
+  md_batch(&md, entries, src, len, h);
+
+  snprintf(path, sizeof(path), "%s/%06d", dir, u);
+  if (mkdir(path, S_IRWXU) && errno != EEXIST) {
+    fprintf(stderr, "Can't create '%s", path);
+    perror("'");
+    return -1;
+  }
+  snprintf(path, sizeof(path), "%s/%06d/%s", dir, u, otpw_file);
+  f = fopen(path, "w");
+  if (!f) {
+    fprintf(stderr, "Can't write to '%s", path);
+    perror("'");
+    return -1;
+  }
+  hdr.entries = hdr.remaining = entries;
+  hdr.challen = challen;
+  hdr.hlen = otpw_hlen;
+  hdr.pwlen = PWCHARS;
+  hdr.next = 0;
+  otpw2_pack_header(header, &hdr);
+  fwrite(header, 1, OTPW2_HDRLEN, f);
+  for (k = 0; k < OTPW2_BITMAPLEN(entries); k++)
+    fputc(0, f);
+  for (k = 0; k < entries; k++) {
+    snprintf(entry, sizeof(entry), "%0*d", challen, k);
+    conv_base64(entry + challen, h + k * MD_LEN, otpw_hlen);
+    fwrite(entry, 1, challen + otpw_hlen, f);
+  }
+  if (fclose(f)) {
+    fprintf(stderr, "Can't write to '%s", path);
+    perror("'");
+    return -1;
+  }
+  free(pw);
+  free(src);
+  free(len);
+  free(h);
+  return 0;
+}
+
+
+/* log in again and again until the deadline */
+static void *worker(void *arg)
+{
+  struct stats *s = arg;
+  struct otpw_ctx ctx;
+  struct challenge ch;
+  struct passwd pwd;
+  char home[PATH_MAX], password[sizeof(PREFIX) + OTPW_MAXMULTI * PWCHARS];
+  unsigned seed = (s - stats) * 7919 + getpid();
+  unsigned char bit;
+  double t0, t1, t2;
+  int u, i, j, n, r;
+
+  otpw_ctx_init(&ctx);
+  ctx.pseudouser = NULL;
+  memset(&pwd, 0, sizeof(pwd));
+  pwd.pw_name = "otpw-load";
+  pwd.pw_dir = home;
+  pwd.pw_uid = geteuid();
+  pwd.pw_gid = getegid();
+  while (now() < deadline) {
+    if (rand_r(&seed) < contention * RAND_MAX)
+      u = 0;
+    else
+      u = rand_r(&seed) % users;
+    snprintf(home, sizeof(home), "%s/%06d", dir, u);
+
+    t0 = now();
+    otpw_prepare_ctx(&ctx, &ch, &pwd, flags);
+    t1 = now();
+    s->logins++;
+    hist_add(s->hist[H_PREPARE], t1 - t0);
+    if (!ch.challenge[0]) {
+      if (ch.remaining > 0)
+	s->blocked++;
+      else
+	s->depleted++;
+      continue;
+    }
+    if (ch.passwords > 1)
+      s->multi++;
+    else
+      s->single++;
+    if (think)
+      usleep(think);
+    if (rand_r(&seed) < abort_rate * RAND_MAX) {
+      /* what pam_otpw does if the login is abandoned */
+      otpw_verify_ctx(&ctx, &ch, "entryaborted");
+      s->aborted++;
+      continue;
+    }
+
+    strcpy(password, PREFIX);
+    n = ch.passwords;  /* (otpw_verify() resets it) */
+    for (i = 0; i < n; i++)
+      password_of(password + strlen(password), u, ch.selection[i]);
+    t2 = now();
+    r = otpw_verify_ctx(&ctx, &ch, password);
+    hist_add(s->hist[H_VERIFY], now() - t2);
+    hist_add(s->hist[H_LOGIN], now() - t2 + t1 - t0);
+    if (r == OTPW_OK) {
+      s->ok++;
+      /* check whether another login has already used these entries */
+      for (i = 0; i < n; i++) {
+	j = u * entries + ch.selection[i];
+	bit = 1 << (j % 8);
+	if (ch.selection[i] < entries &&
+	    __atomic_fetch_or(&used[j / 8], bit, __ATOMIC_RELAXED) & bit)
+	  s->reused++;
+      }
+    } else if (r == OTPW_WRONG)
+      s->wrong++;
+    else
+      s->error++;
+  }
+  return NULL;
+}
+
+
+static void report(int workers, int procs, double secs)
+{
+  struct stats t;
+  unsigned long *a = (unsigned long *) &t, *b;
+  unsigned long challenges;
+  int i, j, h;
+
+  memset(&t, 0, sizeof(t));
+  for (i = 0; i < workers; i++)
+    for (j = 0, b = (unsigned long *) &stats[i];
+	 j < (int) (sizeof(t) / sizeof(*a)); j++)
+      a[j] += b[j];
+  challenges = t.single + t.multi;
+
+  printf("workers %d\n", workers);
+  printf("mode %s\n", procs ? "processes" : "threads");
+  printf("users %d\n", users);
+  printf("entries %d\n", entries);
+  printf("seconds %.3f\n", secs);
+  printf("logins %lu\n", t.logins);
+  printf("logins_per_sec %.1f\n", t.logins / secs);
+  printf("accepted_per_sec %.1f\n", t.ok / secs);
+  printf("single %lu\n", t.single);
+  printf("multi %lu\n", t.multi);
+  printf("blocked %lu\n", t.blocked);
+  printf("depleted %lu\n", t.depleted);
+  printf("aborted %lu\n", t.aborted);
+  printf("ok %lu\n", t.ok);
+  printf("wrong %lu\n", t.wrong);
+  printf("error %lu\n", t.error);
+  printf("reused %lu\n", t.reused);
+  /* a login runs into a lock held by another one if it gets a multi
+   * challenge, or none although passwords remain */
+  printf("multi_rate %.4f\n", challenges ? (double) t.multi / challenges : 0);
+  printf("lock_conflict_rate %.4f\n", t.logins ?
+	 (double) (t.multi + t.blocked) / t.logins : 0);
+  printf("depletion_rate %.4f\n", t.logins ?
+	 (double) t.depleted / t.logins : 0);
+  for (h = 0; h < H_COUNT; h++)
+    for (i = 0; i < HBUCKETS; i++)
+      if (t.hist[h][i])
+	printf("%s_us_lt_%lu %lu\n", hname[h], 2UL << i, t.hist[h][i]);
+}
+
+
+static void usage(void)
+{
+  fprintf(stderr, "Usage: otpw-load -g [-u users] [-n entries] dir\n"
+	  "       otpw-load [-u users] [-j workers] [-P] [-t seconds] "
+	  "[-c contention]\n"
+	  "                 [-a abort] [-w usec] [-L symlink|entry|ofd|none] "
+	  "dir\n");
+  exit(1);
+}
+
+
+int main(int argc, char **argv)
+{
+  int c, i, gen = 0, workers = 4, procs = 0;
+  size_t usedlen;
+  pthread_t *th;
+  pid_t pid;
+  double start;
+
+  while ((c = getopt(argc, argv, "gu:n:j:Pt:c:a:w:L:")) != -1)
+    switch (c) {
+    case 'g': gen = 1; break;
+    case 'u': users = atoi(optarg); break;
+    case 'n': entries = atoi(optarg); break;
+    case 'j': workers = atoi(optarg); break;
+    case 'P': procs = 1; break;
+    case 't': seconds = atof(optarg); break;
+    case 'c': contention = atof(optarg); break;
+    case 'a': abort_rate = atof(optarg); break;
+    case 'w': think = atoi(optarg); break;
+    case 'L':
+      if (!strcmp(optarg, "symlink"))
+	flags = 0;
+      else if (!strcmp(optarg, "entry"))
+	flags = OTPW_ENTRYLOCK;
+      else if (!strcmp(optarg, "ofd"))
+	flags = OTPW_OFDLOCK;
+      else if (!strcmp(optarg, "none"))
+	flags = OTPW_NOLOCK;
+      else
+	usage();
+      break;
+    default:
+      usage();
+    }
+  if (optind != argc - 1 || users < 1 || workers < 1 ||
+      entries < 1 || entries > OTPW_MAXENTRIES)
+    usage();
+  dir = argv[optind];
+
+  if (gen) {
+    if (mkdir(dir, S_IRWXU) && errno != EEXIST) {
+      fprintf(stderr, "Can't create '%s", dir);
+      perror("'");
+      exit(1);
+    }
+    for (i = 0; i < users; i++)
+      if (generate(i))
+	exit(1);
+    return 0;
+  }
+
+  /* take the number of entries from the file of user 0 */
+  {
+    char path[PATH_MAX];
+    unsigned char header[OTPW2_HDRLEN];
+    struct otpw2_header hdr;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s/%06d/%s", dir, 0, otpw_file);
+    f = fopen(path, "r");
+    if (!f || fread(header, 1, sizeof(header), f) != sizeof(header) ||
+	otpw2_unpack_header(&hdr, header)) {
+      fprintf(stderr, "Can't read OTPW2 header of '%s', "
+	      "create test users with -g first.\n", path);
+      exit(1);
+    }
+    fclose(f);
+    entries = hdr.entries;
+  }
+
+  /* counters and bitmap in memory shared also with child processes */
+  usedlen = ((size_t) users * entries + 7) / 8;
+  stats = mmap(NULL, workers * sizeof(struct stats), PROT_READ | PROT_WRITE,
+	       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  used = mmap(NULL, usedlen, PROT_READ | PROT_WRITE,
+	      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  th = malloc(workers * sizeof(*th));
+  if (stats == MAP_FAILED || used == MAP_FAILED || !th) {
+    perror("mmap");
+    exit(1);
+  }
+
+  start = now();
+  deadline = start + seconds;
+  for (i = 0; i < workers; i++)
+    if (procs) {
+      pid = fork();
+      if (pid < 0) {
+	perror("fork");
+	exit(1);
+      } else if (pid == 0) {
+	worker(&stats[i]);
+	_exit(0);
+      }
+    } else if (pthread_create(&th[i], NULL, worker, &stats[i])) {
+      fprintf(stderr, "pthread_create failed\n");
+      exit(1);
+    }
+  for (i = 0; i < workers; i++)
+    if (procs)
+      wait(NULL);
+    else
+      pthread_join(th[i], NULL);
+  report(workers, procs, now() - start);
+  return 0;
+}
@@ -0,0 +1,110 @@
+/*
+ * Print the login counters and latency histograms that pam_otpw and
+ * the OTPW library accumulate in a shared metrics file, in the
+ * Prometheus text exposition format
+ *
+ * Usage: otpw-stat [-f file]
+ *
+ * Markus Kuhn <http://www.cl.cam.ac.uk/~mgk25/>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pwd.h>
+#include "otpw.h"
+
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+static void counter(const char *name, const char *help,
+		    const char *label, const char **values,
+		    const unsigned long long *x, int n)
+{
+  int i;
+
+  printf("# HELP otpw_%s %s\n# TYPE otpw_%s counter\n", name, help, name);
+  if (!label)
+    printf("otpw_%s %llu\n", name, LOAD(x[0]));
+  else
+    for (i = 0; i < n; i++)
+      printf("otpw_%s{%s=\"%s\"} %llu\n", name, label, values[i],
+	     LOAD(x[i]));
+}
+
+static void histogram(const char *name, const char *help,
+		      const unsigned long long *hist,
+		      const unsigned long long *sum)
+{
+  unsigned long long count = 0;
+  int k;
+
+  printf("# HELP otpw_%s %s\n# TYPE otpw_%s histogram\n", name, help, name);
+  for (k = 0; k < OTPW_METRICS_BUCKETS; k++) {
+    count += LOAD(hist[k]);
+    if (k < OTPW_METRICS_BUCKETS - 1)
+      printf("otpw_%s_bucket{le=\"%.7g\"} %llu\n", name,
+	     (double) (1UL << k) / 1e6, count);
+  }
+  printf("otpw_%s_bucket{le=\"+Inf\"} %llu\n", name, count);
+  printf("otpw_%s_sum %.9f\n", name, LOAD(*sum) / 1e9);
+  printf("otpw_%s_count %llu\n", name, count);
+}
+
+int main(int argc, char **argv)
+{
+  static const char *results[] = { "ok", "wrong", "error" };
+  static const char *pam_results[] = {
+    "success", "failure", "unavailable", "unknown_user"
+  };
+  const char *path = OTPW_METRICS_FILE;
+  struct otpw_metrics *m;
+  unsigned long long pam[4];
+  int c;
+
+  while ((c = getopt(argc, argv, "f:")) != -1)
+    switch (c) {
+    case 'f':
+      path = optarg;
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-f file]\n", argv[0]);
+      exit(1);
+    }
+
+  m = otpw_metrics_open(path, 0);
+  if (!m) {
+    fprintf(stderr, "Can't read metrics file '%s", path);
+    perror("'");
+    exit(1);
+  }
+
+  counter("prepares_total", "Calls of otpw_prepare().",
+	  NULL, NULL, &m->prepares, 1);
+  counter("challenges_total", "Challenges issued by otpw_prepare().",
+	  NULL, NULL, &m->challenges, 1);
+  counter("multi_challenges_total",
+	  "Challenges that asked for several passwords.",
+	  NULL, NULL, &m->multi, 1);
+  counter("verifies_total", "Calls of otpw_verify(), by result.",
+	  "result", results, m->verifies, 3);
+  counter("stale_locks_removed_total", "Stale or corrupt locks removed.",
+	  NULL, NULL, &m->stale_locks, 1);
+  counter("write_failures_total",
+	  "Correct passwords that could not be marked as used.",
+	  NULL, NULL, &m->write_failures, 1);
+  pam[0] = LOAD(m->pam_success);
+  pam[1] = LOAD(m->pam_failure);
+  pam[2] = LOAD(m->pam_unavail);
+  pam[3] = LOAD(m->pam_unknown);
+  counter("pam_authenticate_total",
+	  "Authentications by pam_otpw, by result.",
+	  "result", pam_results, pam, 4);
+  histogram("prepare_duration_seconds", "Duration of otpw_prepare().",
+	    m->prepare_us, &m->prepare_ns);
+  histogram("verify_duration_seconds", "Duration of otpw_verify().",
+	    m->verify_us, &m->verify_ns);
+
+  otpw_metrics_close(m);
+  return 0;
+}
@@ -4,11 +4,15 @@
  * Markus Kuhn <http://www.cl.cam.ac.uk/~mgk25/>
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE  /* for F_OFD_SETLK */
+#endif
 #include <stdlib.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
 #include <unistd.h>
 #include <pwd.h>
 #include <time.h>
@@ -16,15 +20,124 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include "otpw.h"
 #include "md.h"
 
+#if defined(__GLIBC__) && \
+  (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 25))
+#define HAVE_GETRANDOM
+#include <sys/random.h>
+#endif
+
 #ifndef DEBUG_LOG
 #define DEBUG_LOG(...) if (ch->flags & OTPW_DEBUG) \
                          { fprintf(stderr, __VA_ARGS__); fputc('\n', stderr); }
 #endif
 
-/* Some global variables with configuration options */
+const char *otpw_phase_name[OTPW_PHASES] = {
+  "nss", "cred", "open", "parse", "lock", "multi", "hash", "write", "release"
+};
+
+/* nanoseconds since some arbitrary point in time */
+static unsigned long long clock_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#ifndef OTPW_NO_STATS
+
+/* add the time since the end of the previous phase to phase p */
+static void stats_phase(struct otpw_stats *st, int p)
+{
+  unsigned long long t = clock_ns();
+
+  if (p >= 0)
+    st->ns[p] += t - st->mark;
+  st->mark = t;
+}
+
+/* record the end of a phase (-1: start), or count an event, in ch->stats */
+#define STATS_PHASE(p) if (ch->flags & OTPW_STATS) stats_phase(ch->stats, p)
+#define STATS_ADD(c, n) if (ch->flags & OTPW_STATS) ch->stats->c += (n)
+#define STATS_COUNT(c) STATS_ADD(c, 1)
+
+#else
+#define STATS_PHASE(p) (void) (p)
+#define STATS_ADD(c, n)
+#define STATS_COUNT(c)
+#endif
+
+/*
+ * Static tracepoints (USDT probes of provider "otpw", for tools such
+ * as bpftrace, perf or SystemTap), where <sys/sdt.h> is available and
+ * OTPW_NO_PROBES is not defined. Each costs a single nop instruction
+ * while no tracer is attached. The probes and their arguments:
+ *
+ *   prepare__entry   length of user name, flags
+ *   prepare__return  length of user name, entries, remaining, passwords
+ *   parse__start     file descriptor
+ *   parse__done      entries, remaining
+ *   lock__acquire    entry, flags
+ *   lock__steal      0: timed out, 1: corrupt, 2: stale entry lock
+ *   lock__release    entry, flags
+ *   hash__start      passwords
+ *   hash__done       passwords, result
+ *   verify__entry    entries, remaining, passwords
+ *   verify__return   entries, remaining, passwords, result
+ *
+ * where passwords is the number of passwords requested (0 if none).
+ */
+#if defined(__has_include) && !defined(OTPW_NO_PROBES)
+#if __has_include(<sys/sdt.h>)
+#define HAVE_SDT
+#endif
+#endif
+
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+#define PROBE1(name, a) DTRACE_PROBE1(otpw, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(otpw, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(otpw, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(otpw, name, a, b, c, d)
+#else
+#define PROBE1(name, a) do { } while (0)
+#define PROBE2(name, a, b) do { } while (0)
+#define PROBE3(name, a, b, c) do { } while (0)
+#define PROBE4(name, a, b, c, d) do { } while (0)
+#endif
+#define NAMELEN(user) ((user) && (user)->pw_name ? \
+		       (int) strlen((user)->pw_name) : 0)
+
+/* count an event in ctx->metrics, if any */
+#define METRICS_COUNT(c) if (ctx->metrics) OTPW_METRICS_ADD(ctx->metrics->c, 1)
+
+/* add the time since t0 to a histogram and sum in a struct otpw_metrics */
+static void metrics_latency(unsigned long long *hist, unsigned long long *sum,
+			    unsigned long long t0)
+{
+  unsigned long long ns = clock_ns() - t0, us = ns / 1000;
+  int k = 0;
+
+  while (us && k < OTPW_METRICS_BUCKETS - 1) {
+    us >>= 1;
+    k++;
+  }
+  OTPW_METRICS_ADD(hist[k], 1);
+  OTPW_METRICS_ADD(*sum, ns);
+}
+
+/*
+ * Some global variables with configuration options (these are the
+ * defaults that otpw_ctx_init() copies into a struct otpw_ctx, and
+ * otpw_prepare() and otpw_verify() use them unchanged)
+ */
 
 /* Path for the one-time password file relative to home directory of
  * the user who tries to log in. (Ignored if otpw_pseudouser != NULL) */
@@ -33,6 +146,15 @@ char *otpw_file   = ".otpw";
 /* Suffix added to the one-time password filename to create lock symlink */
 char *otpw_locksuffix = ".lock";
 
+/* Suffix added to the one-time password filename to create the
+ * directory of per-entry lock symlinks (flag OTPW_ENTRYLOCK) */
+char *otpw_lockdirsuffix = ".locks";
+
+/* Number of per-entry locks that may exist at the same time. Any
+ * further concurrent login gets a multi challenge instead, such that
+ * an attacker cannot lock all passwords. */
+int otpw_maxentrylocks = 10;
+
 /* Number of passwords requested while another one is locked. */
 int otpw_multi = 3;
 
@@ -45,6 +167,9 @@ int otpw_hlen = 12;
 /* Characteristic first line, for recognition of an OTPW file */
 char *otpw_magic = "OTPW1\n";
 
+/* Characteristic first bytes, for recognition of a binary OTPW2 file */
+char *otpw_magic2 = "OTPW2\n";
+
 /*
  * Normally, the password file is located in the home directory of the
  * user who tries to log in, typically in the file ~/.otpw, and is
@@ -123,17 +248,173 @@ int otpw_set_pseudouser(struct otpw_pwdbuf **pseudouser)
 {
   int err;
   err = otpw_getpwnam(otpw_autopseudouser, pseudouser);
-  if (otpw_pseudouser) {
+  if (*pseudouser) {
     if (otpw_autopseudouser_maxuid >= 0 &&
-	otpw_pseudouser->pwd.pw_uid > otpw_autopseudouser_maxuid) {
+	(*pseudouser)->pwd.pw_uid > otpw_autopseudouser_maxuid) {
       err = EINVAL;
       free(*pseudouser);
-      otpw_pseudouser = NULL;
+      *pseudouser = NULL;
     }
   }
   return err;
 }
 
+
+void otpw_ctx_init(struct otpw_ctx *ctx)
+{
+  ctx->file = otpw_file;
+  ctx->locksuffix = otpw_locksuffix;
+  ctx->lockdirsuffix = otpw_lockdirsuffix;
+  ctx->maxentrylocks = otpw_maxentrylocks;
+  ctx->multi = otpw_multi;
+  ctx->hlen = otpw_hlen;
+  ctx->locktimeout = otpw_locktimeout;
+  ctx->pseudouser = otpw_pseudouser;
+  ctx->pseudouser_alloc = 0;
+  ctx->dirfd = -1;
+  ctx->metrics = NULL;
+}
+
+
+int otpw_ctx_set_pseudouser(struct otpw_ctx *ctx)
+{
+  struct otpw_pwdbuf *p = NULL;
+  int err;
+
+  err = otpw_set_pseudouser(&p);
+  if (ctx->pseudouser_alloc && ctx->pseudouser)
+    free(ctx->pseudouser);
+  ctx->pseudouser = p;
+  ctx->pseudouser_alloc = p != NULL;
+  return err;
+}
+
+
+void otpw_ctx_free(struct otpw_ctx *ctx)
+{
+  if (ctx->pseudouser_alloc && ctx->pseudouser)
+    free(ctx->pseudouser);
+  ctx->pseudouser = NULL;
+  ctx->pseudouser_alloc = 0;
+}
+
+/*
+ * Pass an open file descriptor over a Unix domain socket (SCM_RIGHTS),
+ * along with a single dummy byte of data.
+ */
+int otpw_send_fd(int sock, int fd)
+{
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } u;
+  char c = 0;
+
+  memset(&msg, 0, sizeof(msg));
+  memset(&u, 0, sizeof(u));
+  iov.iov_base = &c;
+  iov.iov_len = 1;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = u.buf;
+  msg.msg_controllen = sizeof(u.buf);
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  return sendmsg(sock, &msg, 0) == 1 ? 0 : -1;
+}
+
+
+int otpw_recv_fd(int sock)
+{
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } u;
+  char c;
+  int fd = -1;
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = &c;
+  iov.iov_len = 1;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = u.buf;
+  msg.msg_controllen = sizeof(u.buf);
+  if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1)
+    return -1;
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+	cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+      memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+  return fd;
+}
+
+
+struct otpw_metrics *otpw_metrics_open(const char *path, int writable)
+{
+  struct otpw_metrics *m;
+  struct stat st;
+  unsigned magic = 0;
+  int fd;
+
+  if (writable)
+    fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0644);
+  else
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+  if (fstat(fd, &st)) {
+    close(fd);
+    return NULL;
+  }
+  if (!S_ISREG(st.st_mode) ||
+      (st.st_size < (off_t) sizeof(*m) && !writable)) {
+    close(fd);
+    errno = EINVAL;
+    return NULL;
+  }
+  if (st.st_size < (off_t) sizeof(*m) && ftruncate(fd, sizeof(*m))) {
+    close(fd);
+    return NULL;
+  }
+  m = mmap(NULL, sizeof(*m), writable ? PROT_READ | PROT_WRITE : PROT_READ,
+	   MAP_SHARED, fd, 0);
+  close(fd);
+  if (m == MAP_FAILED)
+    return NULL;
+  /* a newly created file is all zero, which is the initial value of
+   * all counters, and concurrent creators store the same header */
+  if (writable && __atomic_load_n(&m->magic, __ATOMIC_ACQUIRE) == 0) {
+    m->version = OTPW_METRICS_VERSION;
+    __atomic_compare_exchange_n(&m->magic, &magic, OTPW_METRICS_MAGIC, 0,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED);
+  }
+  if (__atomic_load_n(&m->magic, __ATOMIC_ACQUIRE) != OTPW_METRICS_MAGIC ||
+      m->version != OTPW_METRICS_VERSION) {
+    munmap(m, sizeof(*m));
+    errno = EINVAL;
+    return NULL;
+  }
+  return m;
+}
+
+
+void otpw_metrics_close(struct otpw_metrics *m)
+{
+  if (m)
+    munmap(m, sizeof(*m));
+}
+
+
 /*
  * A random bit generator. Hashes together some quick sources of entropy
  * to provide some reasonable random seed. (High entropy is not security
@@ -188,213 +469,892 @@ static void rbg_iter(unsigned char *r)
   md_close(&md, r);
 }
 
+
 /*
- * Transform the first 6*chars bits of the binary string v into a chars
- * character long string s. The encoding is a modification of the MIME
- * base64 encoding where characters with easily confused glyphs are
- * avoided (0 vs O, 1 vs. l vs. I).
+ * A buffer of random words for selecting challenges. It is filled
+ * lazily, with a single getrandom() call where the kernel offers
+ * that, otherwise using rbg_seed()/rbg_iter(). This way, issuing a
+ * single-password challenge needs no random numbers at all, and a
+ * multi challenge only one system call.
  */
 
-static void conv_base64(char *s, const unsigned char *v, int chars)
+#define RNG_WORDS 8
+
+struct otpw_rng {
+  unsigned int word[RNG_WORDS];
+  int avail;                 /* number of words left in word[] */
+  int seeded;                /* flag, whether r has been seeded */
+  unsigned char r[MD_LEN];   /* state of fallback generator */
+};
+
+
+static void rng_fill(struct otpw_rng *rng)
 {
-  static const char tab[] =
-    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijk%mnopqrstuvwxyz"
-    ":=23456789+/";
-  int i, j;
-  
-  for (i = 0; i < chars; i++) {
-    j = (i / 4) * 3;
-    switch (i % 4) {
-    case 0: *s++ = tab[  v[j]  >>2];                        break;
-    case 1: *s++ = tab[((v[j]  <<4) & 0x30) | (v[j+1]>>4)]; break;
-    case 2: *s++ = tab[((v[j+1]<<2) & 0x3c) | (v[j+2]>>6)]; break;
-    case 3: *s++ = tab[  v[j+2]     & 0x3f];                break;
-    }
+  size_t i, chunk;
+
+#ifdef HAVE_GETRANDOM
+  if (getrandom(rng->word, sizeof(rng->word), GRND_NONBLOCK) ==
+      (ssize_t) sizeof(rng->word)) {
+    rng->avail = RNG_WORDS;
+    return;
+  }
+#endif
+  if (!rng->seeded) {
+    rbg_seed(rng->r);
+    rng->seeded = 1;
+  }
+  for (i = 0; i < sizeof(rng->word); i += chunk) {
+    rbg_iter(rng->r);
+    chunk = sizeof(rng->word) - i < MD_LEN ? sizeof(rng->word) - i : MD_LEN;
+    memcpy((unsigned char *) rng->word + i, rng->r, chunk);
   }
-  *s++ = '\0';
+  rng->avail = RNG_WORDS;
 }
 
 
-static void otpw_free(struct challenge *ch)
+static unsigned int rng_word(struct otpw_rng *rng)
 {
-  int i;
+  if (rng->avail < 1)
+    rng_fill(rng);
+  return rng->word[--rng->avail];
+}
+
+/*
+ * The hash values in OTPW files are encoded in a modification of the
+ * MIME base64 encoding where characters with easily confused glyphs
+ * are avoided (0 vs O, 1 vs. l vs. I), see conv_base64() in otpw-gen.c.
+ */
 
-  if (ch->selection) free(ch->selection);
-  if (ch->hash) {
-    for (i = 0; i < otpw_multi; i++) {
-      if (ch->hash[i]) free(ch->hash[i]);
+static const char base64_tab[] =
+  "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijk%mnopqrstuvwxyz"
+  ":=23456789+/";
+
+
+int otpw_decode_hash(unsigned char *v, const char *s, int chars)
+{
+  const char *p;
+  unsigned x;
+  int i, b, err = 0;
+
+  memset(v, 0, MD_LEN);
+  if (chars < 1 || chars > OTPW_MAXHLEN)
+    chars = 0, err = -1;
+  for (i = 0; i < chars; i++) {
+    p = memchr(base64_tab, s[i], 64);
+    if (!p) {
+      err = -1;
+      continue;
     }
-    free(ch->hash);
+    /* put the 6 bits of character i at bit 6*i, most significant first */
+    b = 6 * i;
+    x = (unsigned) (p - base64_tab) << (10 - b % 8);
+    v[b / 8] |= x >> 8;
+    if (b / 8 + 1 < MD_LEN)
+      v[b / 8 + 1] |= x & 0xff;
   }
-  if (ch->filename) free(ch->filename);
-  if (ch->lockfilename) free(ch->lockfilename);
+  if (err)
+    v[MD_LEN - 1] |= 0x0f;  /* beyond 6 * OTPW_MAXHLEN bits: never matches */
+  return err;
 }
 
 
-void otpw_prepare(struct challenge *ch, struct passwd *user, int flags)
+/*
+ * Compare, in constant time, the first 6*chars bits of the hash value h
+ * with those decoded by otpw_decode_hash() into v. Returns 1 if they
+ * are equal, 0 otherwise.
+ */
+static int hash_equal(const unsigned char *h, const unsigned char *v,
+		      int chars)
 {
-  FILE *f = NULL;
-  int i, j;
-  int count, repeat;
-  int olduid = -1;
-  int oldgid = -1;
-  char line[81];
-  char lock[81];
-  unsigned char r[MD_LEN];
-  struct stat lbuf;
-  char *hbuf = NULL;   /* list of challenges and hashed passwords */
-  int hbuflen;
-  
-  if (!ch) {
-    DEBUG_LOG("!ch");
-    return;
-  }
-  ch->passwords = 0;
-  ch->remaining = -1;
-  ch->entries = -1;
-  ch->pwlen = 0;
-  ch->locked = 0;
-  ch->challenge[0] = 0;
-  ch->flags = flags;
-  ch->filename = NULL;
-  ch->lockfilename = NULL;
-  ch->selection = NULL;
-  ch->hash = NULL;
-  ch->selection = (int *) calloc(otpw_multi, sizeof(int));
-  ch->hash = (char **) calloc(otpw_multi, sizeof(char *));
-  if (!ch->selection || !ch->hash) {
-    DEBUG_LOG("calloc() failed");
-    goto cleanup;
-  }
-  if (!user) {
-    DEBUG_LOG("No password database entry provided!");
-    goto cleanup;
+  unsigned char d = 0, mask;
+  int i, bits = 6 * chars;
+
+  for (i = 0; i < MD_LEN; i++) {
+    mask = bits >= 8 * (i + 1) ? 0xff :
+      bits <= 8 * i ? 0 : 0xff << (8 * (i + 1) - bits);
+    d |= (h[i] & mask) ^ v[i];
   }
-  
-  /* prepare filename of one-time password file */
-  if (otpw_pseudouser) {
-    ch->filename = (char *) malloc(strlen(otpw_pseudouser->pwd.pw_dir) + 1 + 
-				   strlen(user->pw_name) + 1);
-    if (!ch->filename) {
-      DEBUG_LOG("malloc() for ch->filename failed");
-      goto cleanup;
+  return d == 0;
+}
+
+
+/* little-endian 32-bit integers in OTPW2 file headers */
+
+static unsigned long get32(const unsigned char *p)
+{
+  return (unsigned long) p[0] | (unsigned long) p[1] << 8 |
+    (unsigned long) p[2] << 16 | (unsigned long) p[3] << 24;
+}
+
+
+static void put32(unsigned char *p, unsigned long v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+
+void otpw2_pack_header(unsigned char *buf, const struct otpw2_header *h)
+{
+  memset(buf, 0, OTPW2_HDRLEN);
+  memcpy(buf, otpw_magic2, strlen(otpw_magic2));
+  put32(buf +  8, h->entries);
+  put32(buf + 12, h->challen);
+  put32(buf + 16, h->hlen);
+  put32(buf + 20, h->pwlen);
+  put32(buf + 24, h->remaining);
+  put32(buf + 28, h->next);
+}
+
+
+int otpw2_unpack_header(struct otpw2_header *h, const unsigned char *buf)
+{
+  if (memcmp(buf, otpw_magic2, strlen(otpw_magic2)))
+    return -1;
+  h->entries   = (int) get32(buf +  8);
+  h->challen   = (int) get32(buf + 12);
+  h->hlen      = (int) get32(buf + 16);
+  h->pwlen     = (int) get32(buf + 20);
+  h->remaining = (int) get32(buf + 24);
+  h->next      = (int) get32(buf + 28);
+  return 0;
+}
+
+
+/*
+ * Count the unused entries in an OTPW2 bitmap and store the index of
+ * the first one in *next (entries if there is none).
+ */
+static int otpw2_scan_bitmap(const unsigned char *bitmap, int entries,
+			     int *next)
+{
+  int i, remaining = 0;
+
+  *next = entries;
+  for (i = 0; i < entries; i++)
+    if (!(bitmap[i/8] & (1 << (i%8)))) {
+      if (!remaining++)
+	*next = i;
     }
-    strcpy(ch->filename, otpw_pseudouser->pwd.pw_dir);
-    strcat(ch->filename, "/");
-    strcat(ch->filename, user->pw_name);
-    ch->uid = otpw_pseudouser->pwd.pw_uid;
-    ch->gid = otpw_pseudouser->pwd.pw_gid;
+  return remaining;
+}
+
+
+/*
+ * A read-only view of an OTPW file mapped into memory, in which entry
+ * i starts at rec + i * recstep (including the line feed in OTPW1
+ * files). An entry is unused if it does not start with '-' and, in an
+ * OTPW2 file, its bit in the bitmap is not set. (We can safely map the
+ * file, because otpw-gen never truncates it, but replaces it via
+ * rename(), and otpw_verify() only overwrites entries in place.)
+ */
+struct otpw_view {
+  char *map;                   /* mmap'ed file, or NULL */
+  size_t maplen;               /* length of mapping */
+  const unsigned char *bitmap; /* OTPW2 bitmap of used entries, or NULL */
+  const char *rec;             /* first entry */
+  int recstep;                 /* distance between entries */
+  int next;                    /* OTPW2 header: first unused entry */
+  int remaining;               /* OTPW2 header: number of unused entries */
+};
+
+#define VIEW_ENTRY(v, i)  ((v)->rec + (size_t) (i) * (v)->recstep)
+
+static int view_unused(const struct otpw_view *v, int i)
+{
+  return VIEW_ENTRY(v, i)[0] != '-' &&
+    !(v->bitmap && (v->bitmap[i/8] & (1 << (i%8))));
+}
+
+
+/*
+ * Check the header of an OTPW1 or OTPW2 file, of which the first len
+ * bytes are in buf, and fill in *h (h->next and h->remaining are -1
+ * for OTPW1). Returns the file format (1 or 2), and sets *rec to the
+ * offset of the first entry and *recstep to the distance between
+ * entries, or returns -1 if this is not a valid OTPW file.
+ */
+static int parse_header(const struct otpw_ctx *ctx, struct challenge *ch,
+			const char *buf, size_t len,
+			struct otpw2_header *h, size_t *rec, int *recstep)
+{
+  const char *p, *eol, *end;
+  char line[81];
+  int format, lines;
+
+  if (len >= OTPW2_HDRLEN &&
+      !otpw2_unpack_header(h, (const unsigned char *) buf)) {
+    /* binary OTPW2 file, header is followed by bitmap of used entries */
+    format = 2;
   } else {
-    ch->filename = (char *) malloc(strlen(user->pw_dir)+1+strlen(otpw_file)+1);
-    if (!ch->filename) {
-      DEBUG_LOG("malloc() for ch->filename failed");
-      goto cleanup;
+    /* text OTPW1 file, header lines may include a '#' comment line */
+    format = 1;
+    p = buf;
+    end = buf + len;
+    for (lines = 0; ; lines++) {
+      eol = memchr(p, '\n', end - p);
+      if (!eol || eol - p + 1 >= (int) sizeof(line) ||
+	  (lines == 0 && (eol - p + 1 != (int) strlen(otpw_magic) ||
+			  memcmp(p, otpw_magic, eol - p + 1)))) {
+	DEBUG_LOG("Header wrong in '%s'!", ch->filename);
+	return -1;
+      }
+      memcpy(line, p, eol - p + 1);
+      line[eol - p + 1] = 0;
+      p = eol + 1;
+      if (lines > 1 || (lines == 1 && line[0] != '#'))
+	break;
     }
-    strcpy(ch->filename, user->pw_dir);
-    strcat(ch->filename, "/");
-    strcat(ch->filename, otpw_file);
-    ch->uid = user->pw_uid;
-    ch->gid = user->pw_gid;
+    if (sscanf(line, "%d%d%d%d\n", &h->entries,
+	       &h->challen, &h->hlen, &h->pwlen) != 4) {
+      DEBUG_LOG("Header wrong in '%s'!", ch->filename);
+      return -1;
+    }
+    h->next = h->remaining = -1;
+    *rec = p - buf;
   }
-  /* prepare associated lock filename */
-  ch->lockfilename = (char *) malloc(strlen(ch->filename) +
-				     strlen(otpw_locksuffix) + 1);
-  if (!ch->lockfilename) {
-    DEBUG_LOG("malloc() for ch->lockfilename failed");
-    goto cleanup;
+  if (h->entries < 1 || h->entries > OTPW_MAXENTRIES ||
+      h->challen < 1 ||
+      (h->challen + 1) * ctx->multi > (int)sizeof(ch->challenge) ||
+      h->challen + h->hlen >= (int)sizeof(line) ||
+      h->hlen < 1 || h->hlen > OTPW_MAXHLEN ||
+      h->pwlen < 4 || h->pwlen > 999 ||
+      h->hlen != ctx->hlen) {
+    DEBUG_LOG("Header parameters (%d %d %d %d) out of allowed range!",
+	      h->entries, h->challen, h->hlen, h->pwlen);
+    return -1;
   }
-  strcpy(ch->lockfilename, ch->filename);
-  strcat(ch->lockfilename, otpw_locksuffix);
-  
-  /* set effective uid/gid temporarily */
-  olduid = geteuid();
-  oldgid = getegid();
-  if (setegid(ch->gid))
-    DEBUG_LOG("Failed to change egid %d -> %d", oldgid, ch->gid);
-  if (seteuid(ch->uid))
-    DEBUG_LOG("Failed to change euid %d -> %d", olduid, ch->uid);
-  
-  /* open password file */
-  if (!(f = fopen(ch->filename, "r"))) {
-    DEBUG_LOG("fopen(\"%s\", \"r\"): %s", ch->filename, strerror(errno));
-    goto cleanup;
+  if (format == 2) {
+    *rec = OTPW2_RECORDS(h->entries);
+    *recstep = h->challen + h->hlen;
+  } else
+    *recstep = h->challen + h->hlen + 1;
+  return format;
+}
+
+
+/*
+ * Map the OTPW file fd into memory and check its header. Set
+ * ch->format, ch->entries, ch->challen, ch->hlen and ch->pwlen and
+ * prepare *v. Returns 0 on success, or -1 if this is not a valid OTPW
+ * file (*v must be passed to view_unmap() in either case).
+ */
+static int view_map(const struct otpw_ctx *ctx, struct challenge *ch, int fd,
+		    struct otpw_view *v)
+{
+  struct stat st;
+  struct otpw2_header h;
+  size_t rec;
+  int i;
+
+  v->map = NULL;
+  v->bitmap = NULL;
+  v->next = v->remaining = -1;
+  if (fstat(fd, &st)) {
+    DEBUG_LOG("fstat(\"%s\"): %s", ch->filename, strerror(errno));
+    return -1;
   }
-  
-  /* prepare random number generator */
-  rbg_seed(r);
-
-  /* check header */
-  if (!fgets(line, sizeof(line), f) ||
-      strcmp(line, otpw_magic) ||
-      !fgets(line, sizeof(line), f) ||
-      ((line[0] == '#') && !fgets(line, sizeof(line), f)) ||
-      sscanf(line, "%d%d%d%d\n", &ch->entries,
-	     &ch->challen, &ch->hlen, &ch->pwlen) != 4) {
-    DEBUG_LOG("Header wrong in '%s'!", ch->filename);
-    goto cleanup;
+  if (st.st_size < (off_t) strlen(otpw_magic) ||
+      st.st_size > (off_t) OTPW_MAXENTRIES * 2 * 81) {
+    DEBUG_LOG("Size of '%s' out of allowed range!", ch->filename);
+    return -1;
   }
-  if (ch->entries < 1 || ch->entries > 9999 ||
-      ch->challen < 1 ||
-      (ch->challen + 1) * otpw_multi > (int)sizeof(ch->challenge) ||
-      ch->pwlen < 4 || ch->pwlen > 999 ||
-      ch->hlen != otpw_hlen) {
-    DEBUG_LOG("Header parameters (%d %d %d %d) out of allowed range!",
-	      ch->entries, ch->challen, ch->hlen, ch->pwlen);
-    goto cleanup;
+  v->maplen = st.st_size;
+  v->map = mmap(NULL, v->maplen, PROT_READ, MAP_SHARED, fd, 0);
+  if (v->map == MAP_FAILED) {
+    v->map = NULL;
+    DEBUG_LOG("mmap(\"%s\"): %s", ch->filename, strerror(errno));
+    return -1;
   }
-  hbuflen = ch->challen + ch->hlen;
-  
-  hbuf =  malloc(ch->entries * hbuflen);
-  if (!hbuf) {
-    DEBUG_LOG("malloc() for hbuf failed");
-    goto cleanup;
+
+  ch->format = parse_header(ctx, ch, v->map, v->maplen, &h, &rec,
+			    &v->recstep);
+  if (ch->format < 0)
+    return -1;
+  ch->entries = h.entries;
+  ch->challen = h.challen;
+  ch->hlen = h.hlen;
+  ch->pwlen = h.pwlen;
+  v->next = h.next;
+  v->remaining = h.remaining;
+  v->rec = v->map + rec;
+  if (ch->format == 2)
+    v->bitmap = (unsigned char *) v->map + OTPW2_HDRLEN;
+  if (rec + (size_t) ch->entries * v->recstep > v->maplen) {
+    DEBUG_LOG("%s too short!", ch->filename);
+    return -1;
   }
-  
-  ch->remaining = 0;
-  j = -1;
-  for (i = 0; i < ch->entries; i++) {
-    if (!fgets(line, sizeof(line), f) ||
-	(int) strlen(line) != hbuflen + 1) {
-      DEBUG_LOG("%s too short!", ch->filename);
-      goto cleanup;
+  if (ch->format == 1)
+    for (i = 0; i < ch->entries; i++)
+      if (VIEW_ENTRY(v, i)[v->recstep - 1] != '\n') {
+	DEBUG_LOG("%s: entry %d has wrong length!", ch->filename, i);
+	return -1;
+      }
+
+  return 0;
+}
+
+
+static void view_unmap(struct otpw_view *v)
+{
+  if (v->map)
+    munmap(v->map, v->maplen);
+  v->map = NULL;
+}
+
+
+/*
+ * Count the unused entries in *v and return the index of the first
+ * one in *first (-1 if there is none).
+ */
+static int view_count(const struct otpw_view *v, int entries, int *first)
+{
+  int i, remaining = 0;
+
+  *first = -1;
+  for (i = 0; i < entries; i++)
+    if (view_unused(v, i)) {
+      if (!remaining++)
+	*first = i;
     }
-    memcpy(hbuf + i*hbuflen, line, hbuflen);
-    if (hbuf[i*hbuflen] != '-') {
+  return remaining;
+}
+
+
+/* is the entry with the challenge string at p among the nlocks locks? */
+static int is_locked(const char *p, int challen, char (*locks)[81], int nlocks)
+{
+  int k;
+
+  for (k = 0; k < nlocks; k++)
+    if (!strncmp(p, locks[k], challen) && !locks[k][challen])
+      return 1;
+  return 0;
+}
+
+
+/*
+ * Store in avail[] the positions of all entries that are available for
+ * a multi challenge, i.e. that are unused and not locked by a
+ * concurrent login, and return their number. Set ch->remaining to the
+ * number of all unused entries.
+ */
+static int view_index(struct challenge *ch, const struct otpw_view *v,
+		      char (*locks)[81], int nlocks,
+		      const unsigned char *locked, int *avail)
+{
+  int i, n = 0;
+
+  ch->remaining = 0;
+  for (i = 0; i < ch->entries; i++)
+    if (view_unused(v, i)) {
       ch->remaining++;
-      if (j < 0)
-	j = i;   /* select first unused hash */
+      if (!is_locked(VIEW_ENTRY(v, i), ch->challen, locks, nlocks) &&
+	  !(locked && locked[i]))
+	avail[n++] = i;
     }
+  return n;
+}
+
+
+/*
+ * Issue a multi challenge of ch->multi passwords, drawn randomly
+ * without replacement from the n entries in avail[]. Returns 0 on
+ * success, -1 otherwise.
+ */
+static int draw_multi(struct challenge *ch, const struct otpw_view *v,
+		      int *avail, int n)
+{
+  int i, j;
+  size_t len;
+  struct otpw_rng rng; /* random numbers for multi challenge */
+
+  rng.avail = rng.seeded = 0;
+  ch->challenge[0] = 0;
+  if (ch->remaining < ch->multi+1 || ch->remaining < 10 || n < ch->multi) {
+    DEBUG_LOG("%d remaining passwords are not enough for "
+	      "multi challenge.", ch->remaining);
+    return -1;
   }
-  if (ch->remaining < 1) {
-    DEBUG_LOG("No passwords left!");
-    goto cleanup;
+  while (ch->passwords < ch->multi &&
+	 strlen(ch->challenge) < sizeof(ch->challenge) - ch->challen - 2) {
+    if (n <= ch->passwords) {
+      DEBUG_LOG("Not enough unused entries left for multi challenge.");
+      ch->challenge[0] = 0;
+      ch->passwords = 0;
+      return -1;
+    }
+    /* draw a random entry without replacement from avail[passwords..n-1] */
+    i = ch->passwords + rng_word(&rng) % (n - ch->passwords);
+    j = avail[i];
+    avail[i] = avail[ch->passwords];
+    /* add password j to multi challenge */
+    len = strlen(ch->challenge);
+    sprintf(ch->challenge + len, "%s%.*s",
+	    ch->passwords ? "/" : "", ch->challen, VIEW_ENTRY(v, j));
+    if (otpw_decode_hash(ch->hash + ch->passwords * MD_LEN,
+			 VIEW_ENTRY(v, j) + ch->challen, ch->hlen) ||
+	!view_unused(v, j) || strchr(ch->challenge + len, '-')) {
+      /* a concurrent login has used entry j since view_index() */
+      ch->challenge[len] = 0;
+      avail[ch->passwords] = avail[--n];
+      continue;
+    }
+    ch->selection[ch->passwords++] = j;
   }
-  strncpy(ch->challenge, hbuf + j*hbuflen, ch->challen);
+  STATS_COUNT(multi);
+  return 0;
+}
+
+
+/*
+ * Make entry j of *v the (first) requested password of ch. As the view
+ * is shared with concurrent logins, call this only once the entry is
+ * locked, and then check again that it is still unused: it may have
+ * been overwritten by a login that held the lock before. Returns 0 on
+ * success, or -1 if the entry turned out to be used.
+ */
+static int take_entry(struct challenge *ch, const struct otpw_view *v, int j)
+{
+  int err;
+
+  strncpy(ch->challenge, VIEW_ENTRY(v, j), ch->challen);
   ch->challenge[ch->challen] = 0;
+  err = otpw_decode_hash(ch->hash, VIEW_ENTRY(v, j) + ch->challen, ch->hlen);
   ch->selection[0] = j;
-  ch->hash[0] = (char *) calloc(ch->hlen + 1, sizeof(char));
-  if (!ch->hash[0]) {
-    DEBUG_LOG("calloc() failed");
-    goto cleanup;
-  }
-  strncpy(ch->hash[0], hbuf + j*hbuflen + ch->challen, ch->hlen);
+  if (err || !view_unused(v, j) || strchr(ch->challenge, '-'))
+    return -1;
+  return 0;
+}
 
-  if (ch->flags & OTPW_NOLOCK) {
-    /* we were told not to worry about locking */
-    ch->passwords = 1;
+
+/*
+ * Byte-range locks (flag OTPW_OFDLOCK): place a write lock (type
+ * F_WRLCK) on the bytes of entry j in ch->fd without waiting, or
+ * remove it again (F_UNLCK). This is an open file description lock
+ * where available, which the kernel releases when ch->fd is closed,
+ * also if the process dies, and which conflicts with locks by other
+ * threads of the same process. Returns 0 on success, -1 otherwise
+ * (errno EAGAIN or EACCES: already locked).
+ */
+static int lock_entry(struct challenge *ch, const struct otpw_view *v, int j,
+		      int type)
+{
+  struct flock fl;
+
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type = type;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = VIEW_ENTRY(v, j) - v->map;
+  fl.l_len = ch->challen + ch->hlen;
+#ifdef F_OFD_SETLK
+  if (fcntl(ch->fd, F_OFD_SETLK, &fl) == 0)
+    return 0;
+  if (errno != EINVAL)
+    return -1;
+  /* kernel without open file description locks (Linux < 3.15) */
+#endif
+  return fcntl(ch->fd, F_SETLK, &fl);
+}
+
+
+/*
+ * Temporary memory for otpw_prepare() and otpw_verify(): taken from
+ * the caller's arena if flag OTPW_ARENA was given and enough of it is
+ * left, otherwise from the heap. scratch_free() only frees the latter;
+ * the arena is reused from the start by the next call.
+ */
+static void *scratch_alloc(struct challenge *ch, size_t size)
+{
+  char *p;
+
+  size = (size + sizeof(long) - 1) & ~(sizeof(long) - 1);
+  if ((ch->flags & OTPW_ARENA) && ch->arena &&
+      size <= ch->arenasize - ch->arenaused) {
+    p = (char *) ch->arena + ch->arenaused;
+    ch->arenaused += size;
+    return p;
+  }
+  return malloc(size);
+}
+
+
+static void scratch_free(struct challenge *ch, void *p)
+{
+  char *a = ch->arena;
+
+  if (p && (!(ch->flags & OTPW_ARENA) || !a ||
+      (char *) p < a || (char *) p >= a + ch->arenasize))
+    free(p);
+}
+
+
+/*
+ * Per-entry locks (flag OTPW_ENTRYLOCK): the entry with challenge
+ * string c is locked by a symlink c -> c in the directory lockdir
+ * (relative to ch->dirfd), which is created if necessary. Read the
+ * names of all locks into the array *locks from scratch_alloc(), and
+ * return their number, or -1 on error. Locks older than
+ * ctx->locktimeout are removed instead, as are names that cannot be
+ * challenge strings.
+ */
+static int read_entrylocks(const struct otpw_ctx *ctx, struct challenge *ch,
+			   const char *lockdir, char (**locks)[81])
+{
+  int fd, n = 0, size = 0;
+  char (*p)[81];
+  DIR *d;
+  struct dirent *de;
+  struct stat st;
+
+  *locks = NULL;
+  if (mkdirat(ch->dirfd, lockdir, S_IRWXU) && errno != EEXIST) {
+    DEBUG_LOG("mkdir(\"%s\"): %s", lockdir, strerror(errno));
+    return -1;
+  }
+  fd = openat(ch->dirfd, lockdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0 || !(d = fdopendir(fd))) {
+    DEBUG_LOG("opendir(\"%s\"): %s", lockdir, strerror(errno));
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+  while ((de = readdir(d))) {
+    if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+      continue;
+    if (fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW))
+      continue;
+    if ((int) strlen(de->d_name) != ch->challen || !S_ISLNK(st.st_mode) ||
+	(ctx->locktimeout > 0 &&
+	 difftime(time(NULL), st.st_mtime) > ctx->locktimeout)) {
+      DEBUG_LOG("Removing stale or corrupt lock '%s/%s'.",
+		lockdir, de->d_name);
+      unlinkat(fd, de->d_name, 0);
+      STATS_COUNT(stale_locks);
+      METRICS_COUNT(stale_locks);
+      PROBE1(lock__steal, 2);
+      continue;
+    }
+    if (n == size) {
+      size = size ? 2 * size : 16;
+      p = scratch_alloc(ch, size * sizeof(**locks));
+      if (!p) {
+	DEBUG_LOG("malloc() for locks failed");
+	closedir(d);
+	return -1;
+      }
+      if (n)
+	memcpy(p, *locks, n * sizeof(**locks));
+      scratch_free(ch, *locks);
+      *locks = p;
+    }
+    strcpy((*locks)[n++], de->d_name);
+  }
+  closedir(d);
+  return n;
+}
+
+
+static void otpw_free(struct challenge *ch)
+{
+  if (ch->fd >= 0) close(ch->fd);
+  if (ch->dirfd >= 0) close(ch->dirfd);
+  ch->fd = ch->dirfd = -1;
+}
+
+
+void otpw_prepare_ctx(const struct otpw_ctx *ctx, struct challenge *ch,
+		      struct passwd *user, int flags)
+{
+  int i, j, n;
+  int count, repeat;
+  int rdonly = 0;      /* password file could only be opened read-only */
+  int olduid = -1;
+  int oldgid = -1;
+  int *avail = NULL;   /* entries available for a multi challenge */
+  char lock[81] = "";
+  char (*locks)[81] = NULL;  /* challenges locked by concurrent logins */
+  int nlocks = 0;
+  struct stat lbuf;
+  struct otpw_view v;  /* challenges and hashed passwords in OTPW file */
+  int phase = OTPW_PHASE_CRED;  /* current phase, for ch->stats */
+  unsigned long long t0 = 0;  /* start time, for ctx->metrics */
+  
+  if (!ch) {
+    DEBUG_LOG("!ch");
+    return;
+  }
+  PROBE2(prepare__entry, NAMELEN(user), flags);
+  if (ctx->metrics)
+    t0 = clock_ns();
+  v.map = NULL;
+  ch->passwords = 0;
+  ch->remaining = -1;
+  ch->entries = -1;
+  ch->pwlen = 0;
+  ch->locked = 0;
+  ch->challenge[0] = 0;
+  ch->flags = flags;
+  ch->multi = ctx->multi;
+  ch->format = 0;
+  ch->filename[0] = 0;
+  ch->lockfilename[0] = 0;
+  ch->fd = ch->dirfd = -1;
+  if (!(flags & OTPW_ARENA)) {
+    ch->arena = NULL;
+    ch->arenasize = 0;
+  }
+  ch->arenaused = 0;
+  if (!ch->stats)
+    ch->flags &= ~OTPW_STATS;
+  if (ch->flags & OTPW_STATS) {
+    memset(ch->stats, 0, sizeof(*ch->stats));
+    STATS_PHASE(-1);
+  }
+  if (ch->multi < 1 || ch->multi > OTPW_MAXMULTI) {
+    DEBUG_LOG("otpw_multi = %d out of range (1..%d)!",
+	      ch->multi, OTPW_MAXMULTI);
+    goto cleanup;
+  }
+  if (!user) {
+    DEBUG_LOG("No password database entry provided!");
+    goto cleanup;
+  }
+  
+  /* prepare filename of one-time password file */
+  if (ctx->pseudouser) {
+    n = snprintf(ch->filename, sizeof(ch->filename), "%s/%s",
+		 ctx->pseudouser->pwd.pw_dir, user->pw_name);
+    ch->nameoff = strlen(ctx->pseudouser->pwd.pw_dir) + 1;
+    ch->uid = ctx->pseudouser->pwd.pw_uid;
+    ch->gid = ctx->pseudouser->pwd.pw_gid;
+  } else {
+    n = snprintf(ch->filename, sizeof(ch->filename), "%s/%s",
+		 user->pw_dir, ctx->file);
+    ch->nameoff = strlen(user->pw_dir) + 1;
+    ch->uid = user->pw_uid;
+    ch->gid = user->pw_gid;
+  }
+  /* prepare associated lock filename (or lock directory name, to
+   * which "/" and the challenge will be appended) */
+  i = snprintf(ch->lockfilename, sizeof(ch->lockfilename), "%s%s",
+	       ch->filename, (ch->flags & OTPW_ENTRYLOCK) ?
+	       ctx->lockdirsuffix : ctx->locksuffix);
+  if (n < 0 || n >= (int) sizeof(ch->filename) || i < 0 ||
+      i + 1 + sizeof(ch->challenge) > sizeof(ch->lockfilename)) {
+    DEBUG_LOG("Path of OTPW file too long!");
+    goto cleanup;
+  }
+  
+  if (ctx->dirfd >= 0) {
+    /* the caller has already opened the directory for us */
+    if ((ch->dirfd = fcntl(ctx->dirfd, F_DUPFD_CLOEXEC, 0)) < 0) {
+      DEBUG_LOG("fcntl(%d, F_DUPFD_CLOEXEC): %s", ctx->dirfd,
+		strerror(errno));
+      goto cleanup;
+    }
+  } else {
+    /* set effective uid/gid temporarily (not needed, e.g., in a server
+     * that already runs as the pseudouser, where the process-wide
+     * credentials must not change under concurrent threads) */
+    if (getegid() != ch->gid) {
+      oldgid = getegid();
+      if (setegid(ch->gid))
+	DEBUG_LOG("Failed to change egid %d -> %d", oldgid, ch->gid);
+    }
+    if (geteuid() != ch->uid) {
+      olduid = geteuid();
+      if (seteuid(ch->uid))
+	DEBUG_LOG("Failed to change euid %d -> %d", olduid, ch->uid);
+    }
+    STATS_PHASE(OTPW_PHASE_CRED);
+    phase = OTPW_PHASE_OPEN;
+    /* open directory of password file */
+    ch->filename[ch->nameoff - 1] = 0;
+    ch->dirfd = open(ch->filename, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (ch->dirfd < 0)
+      DEBUG_LOG("open(\"%s\", O_DIRECTORY): %s", ch->filename,
+		strerror(errno));
+    ch->filename[ch->nameoff - 1] = '/';
+    if (ch->dirfd < 0)
+      goto cleanup;
+  }
+
+  /*
+   * Open password file, for use also by otpw_verify(), which will then
+   * access it and its lock only via ch->fd and ch->dirfd, without
+   * changing uid/gid.
+   */
+  ch->fd = openat(ch->dirfd, ch->filename + ch->nameoff, O_RDWR | O_CLOEXEC);
+  if (ch->fd < 0 && (errno == EACCES || errno == EROFS)) {
+    /* can still issue a challenge, but otpw_verify() will fail to
+     * overwrite the used password */
+    DEBUG_LOG("open(\"%s\", O_RDWR): %s", ch->filename, strerror(errno));
+    ch->fd = openat(ch->dirfd, ch->filename + ch->nameoff,
+		    O_RDONLY | O_CLOEXEC);
+    rdonly = 1;
+  }
+  STATS_PHASE(OTPW_PHASE_OPEN);
+  phase = OTPW_PHASE_PARSE;
+  if (ch->fd < 0) {
+    DEBUG_LOG("open(\"%s\", O_RDONLY): %s", ch->filename, strerror(errno));
+    goto cleanup;
+  }
+  
+  /* map password file and check header */
+  PROBE1(parse__start, ch->fd);
+  if (view_map(ctx, ch, ch->fd, &v))
+    goto cleanup;
+
+  if (ch->format == 2 && v.remaining > 0 &&
+      v.next >= 0 && v.next < ch->entries && view_unused(&v, v.next)) {
+    /* the header tells us directly where the first unused entry is */
+    ch->remaining = v.remaining;
+    j = v.next;
+  } else {
+    if (ch->format == 2)
+      DEBUG_LOG("Header of '%s' out of date, scanning all entries.",
+		ch->filename);
+    ch->remaining = view_count(&v, ch->entries, &j);
+  }
+  if (ch->remaining < 1 || j < 0) {
+    DEBUG_LOG("No passwords left!");
+    goto cleanup;
+  }
+  /* (the hash value is only copied once the entry is locked) */
+  strncpy(ch->challenge, VIEW_ENTRY(&v, j), ch->challen);
+  ch->challenge[ch->challen] = 0;
+  ch->selection[0] = j;
+  PROBE2(parse__done, ch->entries, ch->remaining);
+  STATS_PHASE(OTPW_PHASE_PARSE);
+  phase = OTPW_PHASE_LOCK;
+
+  if ((ch->flags & OTPW_NOLOCK) || (rdonly && (ch->flags & OTPW_OFDLOCK))) {
+    /* we were told not to worry about locking (or cannot place a write
+     * lock on a read-only file, but then otpw_verify() will refuse the
+     * password anyway, as it cannot overwrite it) */
+    for (; j < ch->entries; j++)
+      if (view_unused(&v, j) && take_entry(ch, &v, j) == 0) {
+	ch->passwords = 1;
+	goto cleanup;
+      }
+    DEBUG_LOG("No usable passwords left!");
+    ch->challenge[0] = 0;
     goto cleanup;
   }
 
+  if (ch->flags & OTPW_OFDLOCK) {
+    /* lock the bytes of the first unused entry that no concurrent login
+     * has locked, but skip at most ctx->maxentrylocks locked ones */
+    if (ctx->maxentrylocks > 0 &&
+	!(locks = scratch_alloc(ch, ctx->maxentrylocks * sizeof(*locks)))) {
+      DEBUG_LOG("malloc() for locks failed");
+      ch->challenge[0] = 0;
+      goto cleanup;
+    }
+    for (; nlocks < ctx->maxentrylocks && j < ch->entries; j++) {
+      if (!view_unused(&v, j))
+	continue;
+      STATS_COUNT(lock_tries);
+      if (lock_entry(ch, &v, j, F_WRLCK) == 0) {
+	if (take_entry(ch, &v, j)) {
+	  /* the login that held the lock before has used entry j */
+	  lock_entry(ch, &v, j, F_UNLCK);
+	  continue;
+	}
+	/* ok, we got the lock on entry j, until ch->fd is closed */
+	PROBE2(lock__acquire, j, ch->flags);
+	ch->passwords = 1;
+	goto cleanup;
+      }
+      if (errno != EAGAIN && errno != EACCES) {
+	DEBUG_LOG("fcntl(\"%s\", F_SETLK): %s", ch->filename, strerror(errno));
+	ch->challenge[0] = 0;
+	goto cleanup;
+      }
+      sprintf(locks[nlocks++], "%.*s", ch->challen, VIEW_ENTRY(&v, j));
+      STATS_COUNT(locked);
+    }
+    ch->challenge[0] = 0;
+    DEBUG_LOG("%d entries locked, issuing multi challenge.", nlocks);
+    goto multi;
+  }
+
+  if (ch->flags & OTPW_ENTRYLOCK) {
+    /* lock the first unused entry that no concurrent login has locked,
+     * unless there are already ctx->maxentrylocks locks */
+    nlocks = read_entrylocks(ctx, ch, ch->lockfilename + ch->nameoff,
+			     &locks);
+    if (nlocks < 0) {
+      ch->challenge[0] = 0;
+      goto cleanup;
+    }
+    STATS_ADD(locked, nlocks);
+    n = strlen(ch->lockfilename);
+    for (count = 0; nlocks < ctx->maxentrylocks &&
+	   j < ch->entries && count < 5; j++) {
+      if (!view_unused(&v, j) ||
+	  is_locked(VIEW_ENTRY(&v, j), ch->challen, locks, nlocks))
+	continue;
+      sprintf(ch->lockfilename + n, "/%.*s", ch->challen, VIEW_ENTRY(&v, j));
+      STATS_COUNT(lock_tries);
+      if (symlinkat(ch->lockfilename + n + 1, ch->dirfd,
+		    ch->lockfilename + ch->nameoff) == 0) {
+	if (take_entry(ch, &v, j)) {
+	  /* the login that held the lock before has used entry j */
+	  unlinkat(ch->dirfd, ch->lockfilename + ch->nameoff, 0);
+	  continue;
+	}
+	/* ok, we got the lock on entry j */
+	PROBE2(lock__acquire, j, ch->flags);
+	ch->passwords = 1;
+	ch->locked = 1;
+	goto cleanup;
+      }
+      if (errno != EEXIST) {
+	DEBUG_LOG("symlink(\"%s\"): %s", ch->lockfilename, strerror(errno));
+	ch->challenge[0] = 0;
+	goto cleanup;
+      }
+      /* a concurrent login has just locked this one, try the next */
+      STATS_COUNT(locked);
+      count++;
+    }
+    ch->challenge[0] = 0;
+    DEBUG_LOG("%d entries locked, issuing multi challenge.", nlocks);
+    goto multi;
+  }
+
   count = 0;
   do {
     repeat = 0;
     
     /* try to get a lock on this one */
-    if (symlink(ch->challenge, ch->lockfilename) == 0) {
-      /* ok, we got the lock */
-      ch->passwords = 1;
-      ch->locked = 1;
-      goto cleanup;
+    STATS_COUNT(lock_tries);
+    if (symlinkat(ch->challenge, ch->dirfd,
+		  ch->lockfilename + ch->nameoff) == 0) {
+      /* ok, we got the lock, unless the entry was used meanwhile */
+      if (take_entry(ch, &v, j) == 0) {
+	PROBE2(lock__acquire, j, ch->flags);
+	ch->passwords = 1;
+	ch->locked = 1;
+	goto cleanup;
+      }
+      DEBUG_LOG("Entry %d was used meanwhile, looking again.", j);
+      unlinkat(ch->dirfd, ch->lockfilename + ch->nameoff, 0);
+      ch->remaining = view_count(&v, ch->entries, &j);
+      if (ch->remaining < 1 || j < 0) {
+	DEBUG_LOG("No passwords left!");
+	ch->challenge[0] = 0;
+	goto cleanup;
+      }
+      strncpy(ch->challenge, VIEW_ENTRY(&v, j), ch->challen);
+      ch->challenge[ch->challen] = 0;
+      ch->selection[0] = j;
+      repeat = 1;
+      continue;
     }
     if (errno != EEXIST) {
       DEBUG_LOG("symlink(\"%s\", \"%s\"): %s",
@@ -403,11 +1363,15 @@ void otpw_prepare(struct challenge *ch, struct passwd *user, int flags)
       goto cleanup;
     }
     
-    if (lstat(ch->lockfilename, &lbuf) == 0) {
-      if (otpw_locktimeout > 0 &&
-	  difftime(time(NULL), lbuf.st_mtime) > otpw_locktimeout) {
+    if (fstatat(ch->dirfd, ch->lockfilename + ch->nameoff, &lbuf,
+		AT_SYMLINK_NOFOLLOW) == 0) {
+      if (ctx->locktimeout > 0 &&
+	  difftime(time(NULL), lbuf.st_mtime) > ctx->locktimeout) {
 	/* remove a stale lock after a specified time out period */
-	unlink(ch->lockfilename);
+	unlinkat(ch->dirfd, ch->lockfilename + ch->nameoff, 0);
+	STATS_COUNT(stale_locks);
+	METRICS_COUNT(stale_locks);
+	PROBE1(lock__steal, 0);
 	repeat = 1;
       }
     } else if (errno == ENOENT)
@@ -422,59 +1386,48 @@ void otpw_prepare(struct challenge *ch, struct passwd *user, int flags)
   ch->challenge[0] = 0;
   
   /* ok, there is already a fresh lock, so someone is currently logging in */
-  i = readlink(ch->lockfilename, lock, sizeof(lock)-1);
+  i = readlinkat(ch->dirfd, ch->lockfilename + ch->nameoff,
+		 lock, sizeof(lock)-1);
   if (i > 0) {
     lock[i] = 0;
     if ((int) strlen(lock) != ch->challen) {
       /* lock symlink seems to have been corrupted */
       DEBUG_LOG("Removing corrupt lock symlink to %s -> %s.",
 		ch->lockfilename, lock);
-      unlink(ch->lockfilename);
+      unlinkat(ch->dirfd, ch->lockfilename + ch->nameoff, 0);
+      STATS_COUNT(stale_locks);
+      METRICS_COUNT(stale_locks);
+      PROBE1(lock__steal, 1);
     }
   } else if (errno != ENOENT) {
     DEBUG_LOG("Could not read lock symlink '%s'.", ch->lockfilename);
     goto cleanup;
   }
+  if (lock[0]) {
+    locks = &lock;
+    nlocks = 1;
+    STATS_COUNT(locked);
+  }
   
-  /* now we generate otpw_multi challenges */
-  if (ch->remaining < otpw_multi+1 || ch->remaining < 10) {
-    DEBUG_LOG("%d remaining passwords are not enough for "
-	      "multi challenge.", ch->remaining);
+ multi:
+  STATS_PHASE(phase);
+  phase = OTPW_PHASE_MULTI;
+  /* now we generate ch->multi challenges */
+  avail = (int *) scratch_alloc(ch, ch->entries * sizeof(int));
+  if (!avail) {
+    DEBUG_LOG("malloc() for avail failed");
     goto cleanup;
   }
-  while (ch->passwords < otpw_multi &&
-	 strlen(ch->challenge) < sizeof(ch->challenge) - ch->challen - 2) {
-    count = 0;
-    /* random scan for remaining password */
-    do {
-      /* pick a random entry */
-      rbg_iter(r);
-      j = *((unsigned int *) r) % ch->entries;
-    } while ((hbuf[j*hbuflen] == '-' ||
-	      !strncmp(hbuf + j*hbuflen + ch->challen, lock, ch->challen)) &&
-	     count++ < 2 * ch->entries);
-    /* fallback scan for remaining password */
-    while (hbuf[j*hbuflen] == '-' || 
-	   !strncmp(hbuf + j*hbuflen + ch->challen, lock, ch->challen))
-      j = (j + 1) % ch->entries;
-    /* add password j to multi challenge */
-    sprintf(ch->challenge + strlen(ch->challenge), "%s%.*s",
-	    ch->passwords ? "/" : "", ch->challen, hbuf + j*hbuflen);
-    
-    if (!ch->hash[ch->passwords])
-      ch->hash[ch->passwords] = (char *) calloc(ch->hlen + 1, sizeof(char));
-    if (!ch->hash[ch->passwords]) {
-      DEBUG_LOG("calloc() failed");
-      goto cleanup;
-    }
-    strncpy(ch->hash[ch->passwords], hbuf + j*hbuflen + ch->challen, ch->hlen);
-    ch->selection[ch->passwords++] = j;
-    hbuf[j*hbuflen] = '-'; /* avoid same pw occuring twice per challenge */
-  }
+  n = view_index(ch, &v, locks, nlocks, NULL, avail);
+  draw_multi(ch, &v, avail, n);
 
 cleanup:
-  if (f)
-    fclose(f);
+  STATS_PHASE(phase);
+  view_unmap(&v);
+  scratch_free(ch, avail);
+  if (locks != &lock)
+    scratch_free(ch, locks);
+  STATS_PHASE(OTPW_PHASE_RELEASE);
   /* restore uid/gid */
   if (olduid != -1)
     if (seteuid(olduid))
@@ -482,54 +1435,47 @@ cleanup:
   if (oldgid != -1)
     if (setegid(oldgid))
       DEBUG_LOG("Failed when trying to change egid back to %d", oldgid);
-  if (hbuf)
-    free(hbuf);
-  if (!ch->challenge[0])
+  STATS_PHASE(OTPW_PHASE_CRED);
+  if (!ch->challenge[0]) {
     otpw_free(ch);
+    STATS_PHASE(OTPW_PHASE_RELEASE);
+  }
+  PROBE4(prepare__return, NAMELEN(user), ch->entries, ch->remaining,
+	 ch->passwords);
+  if (ctx->metrics) {
+    OTPW_METRICS_ADD(ctx->metrics->prepares, 1);
+    if (ch->challenge[0])
+      OTPW_METRICS_ADD(ctx->metrics->challenges, 1);
+    if (ch->passwords > 1)
+      OTPW_METRICS_ADD(ctx->metrics->multi, 1);
+    metrics_latency(ctx->metrics->prepare_us, &ctx->metrics->prepare_ns, t0);
+  }
 
   return;
 }
 
 
-int otpw_verify(struct challenge *ch, char *password)
+void otpw_prepare(struct challenge *ch, struct passwd *user, int flags)
 {
-  FILE *f = NULL;
-  int result = OTPW_ERROR;
-  int i, j = 0, l;
-  int entries;
-  int deleted, clear;
-  int olduid = -1;
-  int oldgid = -1;
-  char *otpw = NULL;
-  char line[81];
-  unsigned char h[MD_LEN];
-  md_state md;
-  int challen, pwlen, hlen;
+  struct otpw_ctx ctx;
 
-  if (!ch) {
-    DEBUG_LOG("!ch");
-    return OTPW_ERROR;
-  }
+  otpw_ctx_init(&ctx);
+  otpw_prepare_ctx(&ctx, ch, user, flags);
+}
 
-  if (!password || ch->passwords < 1 ||
-      ch->passwords > otpw_multi) {
-    DEBUG_LOG("otpw_verify(): Invalid parameters or no challenge issued.");
-    goto cleanup;
-  }
-  
-  otpw = calloc(ch->passwords, ch->pwlen);
-  if (!otpw) {
-    DEBUG_LOG("malloc failed");
-    goto cleanup;
-  }
 
-  /* set effective uid/gid temporarily */
-  olduid = geteuid();
-  oldgid = getegid();
-  if (setegid(ch->gid))
-    DEBUG_LOG("Failed when trying to change egid %d -> %d", oldgid, ch->gid);
-  if (seteuid(ch->uid))
-    DEBUG_LOG("Failed when trying to change euid %d -> %d", olduid, ch->uid);
+/*
+ * Split the entered password into the prefix password and the
+ * ch->passwords requested one-time passwords, which are stored one
+ * after another in otpw (ch->passwords * ch->pwlen zero bytes). Returns
+ * the length of the prefix password at the start of password, or -1
+ * if the entered password was too short.
+ */
+static int scan_password(struct challenge *ch, const char *password,
+			 char *otpw)
+{
+  int i, j = 0, l;
+  int deleted;
 
   /*
    * Scan in the one-time passwords, eliminating any spurious characters
@@ -573,105 +1519,743 @@ int otpw_verify(struct challenge *ch, char *password)
   }
   if (i >= 0 || j >= 0) {
     DEBUG_LOG("Entered password was too short.");
-    result = OTPW_WRONG;
-    goto cleanup;
+    return -1;
   }
   
   l++;  /* l is now the length of the prefix password */
   DEBUG_LOG("Prefix = '%.*s'", l, password);
-  
-  /* now compare all entered passwords */
-  for (i = 0; i < ch->passwords; i++) {
-    md_init(&md);
-    /* feed prefix password into hash function */
-    md_add(&md, password, l);
-    /* feed one-time password into hash function */
-    md_add(&md, otpw + i*ch->pwlen, ch->pwlen);
-    /* transform hash result into the base64 form used in ch->filename */
-    md_close(&md, h);
-    conv_base64(line, h, ch->hlen);
-    DEBUG_LOG("hash(password): '%s', hash from file: '%s'",
-	   line, ch->hash[i]);
-    if (strcmp(line, ch->hash[i])) {
-      DEBUG_LOG("Entered password did not match.");
-      result = OTPW_WRONG;
+  return l;
+}
+
+
+int otpw_verify_many(struct otpw_check *c, int n)
+{
+  md_state prefix, *mid = NULL;
+  const void *src0[OTPW_MAXMULTI], **src = src0;
+  size_t len0[OTPW_MAXMULTI], *len = len0;
+  unsigned char h0[OTPW_MAXMULTI * MD_LEN], *h = h0;
+  char *buf = NULL, *p;
+  size_t size = 0;
+  int i, matches = 0;
+
+  for (i = 0; i < n; i++)
+    c[i].ok = 0;
+  if (n < 1)
+    return 0;
+  if (n > OTPW_MAXMULTI) {
+    /* more than a multi challenge needs */
+    src = (const void **) malloc(n * sizeof(void *));
+    len = (size_t *) malloc(n * sizeof(size_t));
+    h = (unsigned char *) malloc(n * MD_LEN);
+    if (!src || !len || !h)
+      goto cleanup;
+  }
+
+  /* a common prefix password is hashed once, into a midstate */
+  for (i = 1; i < n; i++)
+    if (c[i].prefixlen != c[0].prefixlen ||
+	memcmp(c[i].prefix, c[0].prefix, c[0].prefixlen))
+      break;
+  if (i == n) {
+    md_init(&prefix);
+    md_add(&prefix, c[0].prefix, c[0].prefixlen);
+    mid = &prefix;
+    for (i = 0; i < n; i++) {
+      src[i] = c[i].otpw;
+      len[i] = c[i].otpwlen;
+    }
+  } else {
+    /* otherwise, hash prefix and one-time password concatenated */
+    for (i = 0; i < n; i++)
+      size += c[i].prefixlen + c[i].otpwlen;
+    buf = (char *) malloc(size);
+    if (!buf)
       goto cleanup;
+    for (i = 0, p = buf; i < n; i++) {
+      memcpy(p, c[i].prefix, c[i].prefixlen);
+      memcpy(p + c[i].prefixlen, c[i].otpw, c[i].otpwlen);
+      src[i] = p;
+      len[i] = c[i].prefixlen + c[i].otpwlen;
+      p += len[i];
     }
   }
+  md_batch(mid, n, src, len, h);
 
-  /* ok, all passwords were correct */
-  result = OTPW_OK;
-  DEBUG_LOG("Entered password(s) are ok.");
+  /* compare the hash values */
+  for (i = 0; i < n; i++) {
+    if (c[i].hlen < 1 || c[i].hlen > OTPW_MAXHLEN)
+      continue;
+    c[i].ok = hash_equal(h + i * MD_LEN, c[i].hash, c[i].hlen);
+    matches += c[i].ok;
+  }
 
-  /* Now overwrite the used passwords in ch->filename */
-  if (!(f = fopen(ch->filename, "r+"))) {
-    DEBUG_LOG("Failed getting write access to '%s': %s",
-	      ch->filename, strerror(errno));
-    goto writefail;
+ cleanup:
+  if (buf) {
+    memset(buf, 0, size);
+    free(buf);
+  }
+  if (src && src != src0)
+    free(src);
+  if (len && len != len0)
+    free(len);
+  if (h && h != h0)
+    free(h);
+  memset(&prefix, 0, sizeof(prefix));
+  return matches;
+}
+
+
+/*
+ * Check the entered password (prefix password followed by the
+ * ch->passwords requested one-time passwords) against ch->hash[].
+ * Returns OTPW_OK, OTPW_WRONG, or OTPW_ERROR.
+ */
+static int check_password(struct challenge *ch, const char *password)
+{
+  int i, l, result = OTPW_WRONG;
+  char otpw[OTPW_MAXMULTI * OTPW_MAXPWLEN];
+  struct otpw_check c[OTPW_MAXMULTI];
+
+  memset(otpw, 0, ch->passwords * ch->pwlen);
+  l = scan_password(ch, password, otpw);
+  if (l < 0)
+    goto cleanup;
+
+  /* now compare all entered passwords, hashing the prefix only once */
+  for (i = 0; i < ch->passwords; i++) {
+    c[i].prefix = password;
+    c[i].prefixlen = l;
+    c[i].otpw = otpw + i*ch->pwlen;
+    c[i].otpwlen = ch->pwlen;
+    c[i].hash = ch->hash + i * MD_LEN;
+    c[i].hlen = ch->hlen;
   }
-  /* check header */
-  if (!fgets(line, sizeof(line), f) ||
-      strcmp(line, otpw_magic) ||
-      !fgets(line, sizeof(line), f) ||
-      ((line[0] == '#') && !fgets(line, sizeof(line), f)) ||
-      sscanf(line, "%d%d%d%d\n", &entries,
-	     &challen, &hlen, &pwlen) != 4 ||
-      entries != ch->entries || pwlen != ch->pwlen ||
-      hlen != ch->hlen || challen != ch->challen ||
-      (challen + 1) * otpw_multi > (int) sizeof(ch->challenge)) {
+  if (otpw_verify_many(c, ch->passwords) == ch->passwords) {
+    DEBUG_LOG("Entered password(s) are ok.");
+    result = OTPW_OK;
+  } else
+    DEBUG_LOG("Entered password did not match.");
+
+ cleanup:
+  memset(otpw, 0, ch->passwords * ch->pwlen);
+  return result;
+}
+
+
+/*
+ * Read the header (and OTPW2 bitmap) of the OTPW file fd into head
+ * (of size OTPW2_RECORDS(OTPW_MAXENTRIES)), and check that it still
+ * matches ch. Returns 0 if so, -1 otherwise.
+ */
+static int read_header(const struct otpw_ctx *ctx, struct challenge *ch,
+		       int fd, unsigned char *head, struct otpw2_header *hdr,
+		       size_t *rec, int *recstep)
+{
+  struct stat st;
+  ssize_t len;
+
+  len = pread(fd, head, OTPW2_RECORDS(OTPW_MAXENTRIES), 0);
+  if (len < 0 ||
+      parse_header(ctx, ch, (char *) head, len, hdr, rec, recstep) !=
+      ch->format ||
+      hdr->entries != ch->entries || hdr->pwlen != ch->pwlen ||
+      hdr->hlen != ch->hlen || hdr->challen != ch->challen ||
+      fstat(fd, &st) ||
+      st.st_size < (off_t) (*rec + (size_t) hdr->entries * *recstep)) {
     DEBUG_LOG("Overwrite failed because of header mismatch.");
-    goto writefail;
+    return -1;
   }
-  for (i = 0; i < entries; i++) {
-    clear = 0;
-    for (j = 0; j < ch->passwords; j++)
-      if (ch->selection[j] == i)
-	clear = 1;
-    if (clear) {
-      fseek(f, 0L, SEEK_CUR);
-      for (l = 0; l < challen + hlen; l++)
-	fputc('-', f);
-      fputc('\n', f);
-      fseek(f, 0L, SEEK_CUR);
+  return 0;
+}
+
+
+/*
+ * Lock (type F_WRLCK) or unlock (F_UNLCK) the header and bitmap of
+ * the OTPW2 file fd, i.e. the bytes before its first entry (in an
+ * OTPW1 file only its first byte), waiting for the lock if necessary.
+ * With per-entry locks, several calls of otpw_verify() can update the
+ * bitmap at the same time, and each rewrites all of it, so they have
+ * to take turns. The lock never overlaps those of lock_entry().
+ * Returns 0 on success, -1 otherwise.
+ */
+static int lock_header(struct challenge *ch, int fd, int type)
+{
+  struct flock fl;
+
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type = type;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = 0;
+  fl.l_len = ch->format == 2 ? OTPW2_RECORDS(ch->entries) : 1;
+#ifdef F_OFD_SETLKW
+  if (fcntl(fd, F_OFD_SETLKW, &fl) == 0)
+    return 0;
+  if (errno != EINVAL)
+    return -1;
+  /* kernel without open file description locks (Linux < 3.15) */
+#endif
+  return fcntl(fd, F_SETLKW, &fl);
+}
+
+
+/*
+ * Overwrite the entries ch->selection[] in the OTPW file fd as used,
+ * and update ch->remaining (and, in an OTPW2 file, the header and
+ * bitmap). This happens under lock_header(), after checking that no
+ * concurrent login has used any of these entries since otpw_prepare():
+ * a multi challenge locks none of its entries, so another login may
+ * have drawn or locked the same entry. Returns 0 on success, 1 if an
+ * entry has been used meanwhile, -1 otherwise.
+ */
+static int overwrite_entries(const struct otpw_ctx *ctx, struct challenge *ch,
+			     int fd)
+{
+  int i, j, l, result = -1;
+  char line[81];
+  unsigned char head[OTPW2_RECORDS(OTPW_MAXENTRIES)];
+  unsigned char *bitmap;
+  struct otpw2_header hdr;
+  size_t rec;
+  int recstep;
+
+  if (lock_header(ch, fd, F_WRLCK)) {
+    DEBUG_LOG("Locking header of '%s' failed: %s", ch->filename,
+	      strerror(errno));
+    return -1;
+  }
+  if (read_header(ctx, ch, fd, head, &hdr, &rec, &recstep))
+    goto unlock;
+  bitmap = head + OTPW2_HDRLEN;
+  for (i = 0; i < ch->passwords; i++) {
+    j = ch->selection[i];
+    if (pread(fd, line, 1, rec + (off_t) j * recstep) != 1) {
+      DEBUG_LOG("Reading entry %d failed: %s", j, strerror(errno));
+      goto unlock;
+    }
+    if (line[0] == '-' ||
+	(ch->format == 2 && (bitmap[j/8] & (1 << (j%8))))) {
+      DEBUG_LOG("Entry %d has been used meanwhile.", j);
+      result = 1;
+      goto unlock;
+    }
+  }
+  /* overwrite each entry at its offset, keeping the OTPW1 line feed */
+  l = ch->challen + ch->hlen;
+  memset(line, '-', l);
+  for (i = 0; i < ch->passwords; i++) {
+    j = ch->selection[i];
+    if (pwrite(fd, line, l, rec + (off_t) j * recstep) != l) {
+      DEBUG_LOG("Overwrite of entry %d failed: %s", j, strerror(errno));
+      goto unlock;
+    }
+    if (ch->format == 2)
+      bitmap[j/8] |= 1 << (j%8);
+    else
       ch->remaining--;
-    } else
-      if (!fgets(line, sizeof(line), f)) {
-	DEBUG_LOG("Overwrite failed because of unexpected EOF.");
-	goto writefail;
-      }
   }
+  if (ch->format == 2) {
+    /* update header and the adjacent bitmap after the entries */
+    hdr.remaining = otpw2_scan_bitmap(bitmap, hdr.entries, &hdr.next);
+    otpw2_pack_header(head, &hdr);
+    if (pwrite(fd, head, OTPW2_RECORDS(hdr.entries), 0) !=
+	OTPW2_RECORDS(hdr.entries)) {
+      DEBUG_LOG("Update of header failed: %s", strerror(errno));
+      goto unlock;
+    }
+    ch->remaining = hdr.remaining;
+  }
+  result = 0;
+
+ unlock:
+  lock_header(ch, fd, F_UNLCK);
+  return result;
+}
+
+
+int otpw_verify_ctx(const struct otpw_ctx *ctx, struct challenge *ch,
+		    char *password)
+{
+  int result = OTPW_ERROR, written;
+  unsigned long long t0 = 0;  /* start time, for ctx->metrics */
+
+  if (!ch) {
+    DEBUG_LOG("!ch");
+    return OTPW_ERROR;
+  }
+
+  PROBE3(verify__entry, ch->entries, ch->remaining, ch->passwords);
+  if (ctx->metrics)
+    t0 = clock_ns();
+  STATS_PHASE(-1);
+  if (!password || ch->passwords < 1 ||
+      ch->passwords > ch->multi) {
+    DEBUG_LOG("otpw_verify(): Invalid parameters or no challenge issued.");
+    goto cleanup;
+  }
+
+  PROBE1(hash__start, ch->passwords);
+  result = check_password(ch, password);
+  PROBE2(hash__done, ch->passwords, result);
+  STATS_PHASE(OTPW_PHASE_HASH);
+  if (result != OTPW_OK)
+    goto cleanup;
+
+  /* Now overwrite the used passwords in the file that we opened in
+   * otpw_prepare() (even if otpw-gen has replaced it since) */
+  written = overwrite_entries(ctx, ch, ch->fd);
+  STATS_PHASE(OTPW_PHASE_WRITE);
+  if (written > 0) {
+    /* a concurrent login has already used one of these passwords */
+    result = OTPW_WRONG;
+    goto cleanup;
+  }
+  if (written < 0)
+    goto writefail;
   goto cleanup;
 
  writefail:
   /* entered one-time passwords were correct, but overwriting them failed */
-  if (ch->passwords == 1) {
+  METRICS_COUNT(write_failures);
+  if (ch->passwords == 1 && (ch->flags & OTPW_OFDLOCK)) {
+    /* closing ch->fd releases the lock, after which the password
+     * could be used again, so we cannot permit this login */
+    DEBUG_LOG("Refusing login, as the password remains valid.");
+    result = OTPW_ERROR;
+  } else if (ch->passwords == 1) {
     /* for a single password, permit login, but keep lock in place */
     DEBUG_LOG("Keeping lock on password.");
     ch->locked = 0; /* supress removal of lock */
   }
 
  cleanup:
-  if (f)
-    fclose(f);
   /* remove lock */ 
   if (ch->locked) {
     DEBUG_LOG("Removing lock file");
-    if (unlink(ch->lockfilename))
+    if (unlinkat(ch->dirfd, ch->lockfilename + ch->nameoff, 0))
       DEBUG_LOG("Failed when trying to unlink lock file: %s", strerror(errno));
   }
-  /* restore uid/gid */
-  if (olduid != -1)
-    if (seteuid(olduid))
-      DEBUG_LOG("Failed when trying to change euid back to %d", olduid);
-  if (oldgid != -1)
-    if (setegid(oldgid))
-      DEBUG_LOG("Failed when trying to change egid back to %d", oldgid);
+  if (ch->locked || (ch->passwords == 1 && (ch->flags & OTPW_OFDLOCK)))
+    PROBE2(lock__release, ch->selection[0], ch->flags);
+  PROBE4(verify__return, ch->entries, ch->remaining, ch->passwords, result);
   /* make sure, we are not called a second time */
   ch->passwords = 0;
 
-  if (otpw)
-    free(otpw);
   otpw_free(ch);
+  STATS_PHASE(OTPW_PHASE_RELEASE);
+  if (ctx->metrics) {
+    OTPW_METRICS_ADD(ctx->metrics->verifies[result], 1);
+    metrics_latency(ctx->metrics->verify_us, &ctx->metrics->verify_ns, t0);
+  }
+
+  return result;
+}
+
+
+int otpw_verify(struct challenge *ch, char *password)
+{
+  struct otpw_ctx ctx;
+
+  otpw_ctx_init(&ctx);
+  return otpw_verify_ctx(&ctx, ch, password);
+}
+
+
+/*
+ * OTPW files held open by a long-running server, which keeps the
+ * locks of pending challenges in memory, see struct otpw_table.
+ */
+
+int otpw_table_open(const struct otpw_ctx *ctx, struct otpw_table *t,
+		    struct passwd *user, int flags)
+{
+  struct challenge *ch = &t->file;
+  struct stat st;
+
+  memset(t, 0, sizeof(*t));
+  /* let otpw_prepare_ctx() find and open the file for us */
+  otpw_prepare_ctx(ctx, ch, user, flags | OTPW_NOLOCK);
+  if (!ch->challenge[0])
+    return -1;
+  ch->passwords = 0;
+  t->view = (struct otpw_view *) malloc(sizeof(struct otpw_view));
+  if (!t->view) {
+    DEBUG_LOG("malloc() for t->view failed");
+    otpw_table_close(t);
+    return -1;
+  }
+  if (view_map(ctx, ch, ch->fd, t->view) || fstat(ch->fd, &st)) {
+    otpw_table_close(t);
+    return -1;
+  }
+  t->locked = (unsigned char *) calloc(ch->entries, 1);
+  if (!t->locked) {
+    DEBUG_LOG("calloc() for t->locked failed");
+    otpw_table_close(t);
+    return -1;
+  }
+  t->dev = st.st_dev;
+  t->ino = st.st_ino;
+  t->remaining = view_count(t->view, ch->entries, &t->next);
+  if (t->next < 0)
+    t->next = ch->entries;
+  return 0;
+}
+
+
+int otpw_table_changed(struct otpw_table *t)
+{
+  struct stat st;
+
+  if (fstatat(t->file.dirfd, t->file.filename + t->file.nameoff, &st, 0))
+    return 1;
+  return st.st_dev != t->dev || st.st_ino != t->ino;
+}
+
+
+void otpw_table_close(struct otpw_table *t)
+{
+  if (t->view) {
+    view_unmap(t->view);
+    free(t->view);
+    t->view = NULL;
+  }
+  if (t->locked) {
+    free(t->locked);
+    t->locked = NULL;
+  }
+  otpw_free(&t->file);
+}
+
 
+void otpw_table_prepare(const struct otpw_ctx *ctx, struct otpw_table *t,
+			struct challenge *ch, int flags)
+{
+  const struct otpw_view *v = t->view;
+  int *avail = NULL;
+  int j, n;
+
+  ch->passwords = 0;
+  ch->locked = 0;
+  ch->challenge[0] = 0;
+  ch->filename[0] = 0;
+  ch->lockfilename[0] = 0;
+  if (!(flags & OTPW_ARENA)) {
+    ch->arena = NULL;
+    ch->arenasize = 0;
+  }
+  ch->arenaused = 0;
+  ch->flags = flags & ~OTPW_STATS;
+  ch->multi = ctx->multi;
+  ch->format = t->file.format;
+  ch->entries = t->file.entries;
+  ch->pwlen = t->file.pwlen;
+  ch->challen = t->file.challen;
+  ch->hlen = t->file.hlen;
+  ch->remaining = t->remaining;
+  ch->uid = t->file.uid;
+  ch->gid = t->file.gid;
+  ch->fd = ch->dirfd = -1;
+  if (ch->multi < 1 || ch->multi > OTPW_MAXMULTI) {
+    DEBUG_LOG("otpw_multi = %d out of range (1..%d)!",
+	      ch->multi, OTPW_MAXMULTI);
+    goto cleanup;
+  }
+
+  /* skip entries used since the last call */
+  while (t->next < ch->entries && !view_unused(v, t->next))
+    t->next++;
+  if (t->remaining < 1) {
+    DEBUG_LOG("No passwords left!");
+    goto cleanup;
+  }
+
+  /* lock the first unused entry that no pending challenge has locked,
+   * unless there are already ctx->maxentrylocks locks */
+  for (j = t->next; j < ch->entries &&
+	 ((flags & OTPW_NOLOCK) || t->nlocked < ctx->maxentrylocks); j++)
+    if (view_unused(v, j) && !t->locked[j] && take_entry(ch, v, j) == 0) {
+      ch->passwords = 1;
+      if (!(flags & OTPW_NOLOCK)) {
+	t->locked[j] = 1;
+	t->nlocked++;
+	ch->locked = 1;
+      }
+      goto cleanup;
+    }
+  ch->challenge[0] = 0;
+
+  /* otherwise issue a multi challenge, excluding all locked entries,
+   * and lock its entries as well, such that concurrent multi challenges
+   * do not overlap (unless there are not enough unlocked entries left) */
+  DEBUG_LOG("%d entries locked, issuing multi challenge.", t->nlocked);
+  avail = (int *) scratch_alloc(ch, ch->entries * sizeof(int));
+  if (!avail) {
+    DEBUG_LOG("malloc() for avail failed");
+    goto cleanup;
+  }
+  n = view_index(ch, v, NULL, 0, t->locked, avail);
+  if (n < ch->multi || (flags & OTPW_NOLOCK)) {
+    n = view_index(ch, v, NULL, 0, NULL, avail);
+    draw_multi(ch, v, avail, n);
+  } else if (!draw_multi(ch, v, avail, n)) {
+    for (j = 0; j < ch->passwords; j++)
+      t->locked[ch->selection[j]] = 2;
+    ch->locked = 1;
+  }
+
+ cleanup:
+  scratch_free(ch, avail);
+  if (!ch->challenge[0])
+    otpw_free(ch);
+}
+
+
+int otpw_table_verify(const struct otpw_ctx *ctx, struct otpw_table *t,
+		      struct challenge *ch, char *password)
+{
+  struct otpw_verify_req req;
+
+  req.t = t;
+  req.ch = ch;
+  req.password = password;
+  otpw_table_verify_batch(ctx, &req, 1);
+  return req.result;
+}
+
+
+/*
+ * Overwrite the entries used by the accepted requests req[i] on table
+ * t (those with todo[i] >= 0, which are then set to -1), with one
+ * pwritev() per run of adjacent entries (or, beyond IOV_MAX, a few),
+ * then update the header and bitmap of an OTPW2 file with one pwrite(),
+ * followed by a single fdatasync(). All this happens under
+ * lock_header(), like in otpw_verify(). A request that uses an entry
+ * that has already been used is rejected. Returns 0 on success, -1
+ * otherwise.
+ */
+static int table_write(const struct otpw_ctx *ctx, struct otpw_table *t,
+		       struct otpw_verify_req *req, int n, int *todo)
+{
+  struct challenge *ch = &t->file;
+  const struct otpw_view *v = t->view;
+  unsigned char head[OTPW2_RECORDS(OTPW_MAXENTRIES)];
+  unsigned char *taken = NULL;
+  struct otpw2_header hdr;
+  struct iovec iov[IOV_MAX];
+  char line[81];
+  size_t rec, chunk;
+  ssize_t len;
+  int i, j, k, l, cnt = 0, locked = 0, result = -1;
+  int recstep;
+
+  if (lock_header(ch, ch->fd, F_WRLCK)) {
+    DEBUG_LOG("Locking header of '%s' failed: %s", ch->filename,
+	      strerror(errno));
+    goto cleanup;
+  }
+  locked = 1;
+  taken = (unsigned char *) calloc(ch->entries, 1);
+  if (!taken) {
+    DEBUG_LOG("calloc() for taken failed");
+    goto cleanup;
+  }
+  /* which entries to overwrite, rejecting any reuse */
+  for (i = 0; i < n; i++) {
+    if (todo[i] < 0 || req[i].t != t)
+      continue;
+    for (j = 0; j < req[i].ch->passwords; j++) {
+      k = req[i].ch->selection[j];
+      if (!view_unused(v, k) || taken[k])
+	break;
+    }
+    if (j < req[i].ch->passwords) {
+      DEBUG_LOG("Entry %d has been used meanwhile.", k);
+      req[i].result = OTPW_WRONG;
+      continue;
+    }
+    for (j = 0; j < req[i].ch->passwords; j++)
+      taken[req[i].ch->selection[j]] = 1;
+    cnt += req[i].ch->passwords;
+  }
+  if (!cnt) {
+    result = 0;
+    goto cleanup;
+  }
+
+  if (read_header(ctx, ch, ch->fd, head, &hdr, &rec, &recstep))
+    goto cleanup;
+  /* each entry becomes a line of '-', which in an OTPW1 file includes
+   * its line feed, such that adjacent entries are written together */
+  l = ch->challen + ch->hlen;
+  memset(line, '-', l);
+  line[l] = '\n';
+  for (i = 0; i < IOV_MAX; i++) {
+    iov[i].iov_base = line;
+    iov[i].iov_len = recstep;
+  }
+  for (k = 0; k < ch->entries; k = j) {
+    if (!taken[k]) {
+      j = k + 1;
+      continue;
+    }
+    /* write the run of entries k .. j-1 */
+    for (j = k; j < ch->entries && taken[j] && j - k < IOV_MAX; j++) ;
+    chunk = (size_t) (j - k) * recstep;
+    len = pwritev(ch->fd, iov, j - k, rec + (size_t) k * recstep);
+    if (len < 0 || (size_t) len != chunk) {
+      DEBUG_LOG("Overwrite of entries %d..%d failed: %s", k, j - 1,
+		len < 0 ? strerror(errno) : "short write");
+      goto cleanup;
+    }
+  }
+  if (ch->format == 2) {
+    /* update header and bitmap as read under the lock */
+    for (k = 0; k < ch->entries; k++)
+      if (taken[k])
+	head[OTPW2_HDRLEN + k/8] |= 1 << (k%8);
+    hdr.remaining = otpw2_scan_bitmap(head + OTPW2_HDRLEN, hdr.entries,
+				      &hdr.next);
+    otpw2_pack_header(head, &hdr);
+    if (pwrite(ch->fd, head, OTPW2_RECORDS(hdr.entries), 0) !=
+	OTPW2_RECORDS(hdr.entries)) {
+      DEBUG_LOG("Update of header failed: %s", strerror(errno));
+      goto cleanup;
+    }
+  }
+  if (fdatasync(ch->fd)) {
+    DEBUG_LOG("fdatasync() failed: %s", strerror(errno));
+    goto cleanup;
+  }
+  t->remaining = ch->format == 2 ? hdr.remaining : t->remaining - cnt;
+  result = 0;
+
+ cleanup:
+  for (i = 0; i < n; i++)
+    if (req[i].t == t)
+      todo[i] = -1;
+  if (locked)
+    lock_header(ch, ch->fd, F_UNLCK);
+  if (taken)
+    free(taken);
   return result;
 }
+
+
+int otpw_table_verify_batch(const struct otpw_ctx *ctx,
+			    struct otpw_verify_req *req, int n)
+{
+  struct challenge *ch;
+  struct otpw_check *c = NULL;
+  char *buf = NULL, *otpw;
+  size_t size = 0;
+  int *todo = NULL;
+  int i, j, k, m = 0, files = 0;
+
+  /* allocate room for all one-time passwords to be checked */
+  for (i = 0; i < n; i++) {
+    ch = req[i].ch;
+    req[i].result = OTPW_ERROR;
+    if (!req[i].password || ch->passwords < 1 ||
+	ch->passwords > ch->multi) {
+      DEBUG_LOG("otpw_table_verify(): Invalid parameters or no challenge "
+		"issued.");
+      continue;
+    }
+    m += ch->passwords;
+    size += ch->passwords * ch->pwlen;
+  }
+  if (m == 0)
+    goto cleanup;
+  buf = (char *) calloc(size, 1);
+  c = (struct otpw_check *) malloc(m * sizeof(*c));
+  todo = (int *) malloc(n * sizeof(int));
+  if (!buf || !c || !todo)
+    goto cleanup;
+
+  /* split each entered password into its prefix and one-time passwords,
+   * and check them all together */
+  for (i = m = 0, otpw = buf; i < n; i++) {
+    ch = req[i].ch;
+    todo[i] = -1;
+    if (!req[i].password || ch->passwords < 1 ||
+	ch->passwords > ch->multi)
+      continue;
+    req[i].result = OTPW_WRONG;
+    k = scan_password(ch, req[i].password, otpw);
+    if (k < 0)
+      continue;
+    todo[i] = m;
+    for (j = 0; j < ch->passwords; j++, m++) {
+      c[m].prefix = req[i].password;
+      c[m].prefixlen = k;
+      c[m].otpw = otpw + j * ch->pwlen;
+      c[m].otpwlen = ch->pwlen;
+      c[m].hash = ch->hash + j * MD_LEN;
+      c[m].hlen = ch->hlen;
+    }
+    otpw += ch->passwords * ch->pwlen;
+  }
+  otpw_verify_many(c, m);
+  for (i = 0; i < n; i++) {
+    if (todo[i] < 0)
+      continue;
+    ch = req[i].ch;
+    for (j = 0; j < ch->passwords && c[todo[i] + j].ok; j++) ;
+    if (j < ch->passwords) {
+      DEBUG_LOG("Entered password did not match.");
+      todo[i] = -1;
+    } else
+      req[i].result = OTPW_OK;
+  }
+
+  /* overwrite the used entries, once per table */
+  for (i = 0; i < n; i++) {
+    if (todo[i] < 0)
+      continue;
+    ch = req[i].ch;
+    if (table_write(ctx, req[i].t, req + i, n - i, todo + i)) {
+      DEBUG_LOG("Writing to '%s' failed.", req[i].t->file.filename);
+      for (j = i; j < n; j++)
+	if (req[j].t == req[i].t && req[j].result == OTPW_OK &&
+	    req[j].ch->passwords == 1) {
+	  /* for a single password, permit login, but keep lock in place */
+	  req[j].ch->locked = 0;
+	}
+    }
+    files++;
+  }
+
+ cleanup:
+  for (i = 0; i < n; i++) {
+    req[i].ch->remaining = req[i].t->remaining;
+    otpw_table_release(req[i].t, req[i].ch);
+  }
+  if (buf) {
+    memset(buf, 0, size);
+    free(buf);
+  }
+  if (c)
+    free(c);
+  if (todo)
+    free(todo);
+  return files;
+}
+
+
+void otpw_table_release(struct otpw_table *t, struct challenge *ch)
+{
+  int i, j;
+
+  for (i = 0; ch->locked && i < ch->passwords; i++) {
+    j = ch->selection[i];
+    if (j >= 0 && j < t->file.entries && t->locked[j]) {
+      /* only locks of single password challenges count */
+      if (t->locked[j] == 1)
+	t->nlocked--;
+      t->locked[j] = 0;
+    }
+  }
+  ch->locked = 0;
+  ch->passwords = 0;
+  otpw_free(ch);
+}
@@ -8,6 +8,7 @@
 #define OTPW_H
 
 #include <pwd.h>
+#include <limits.h>
 #include <sys/types.h>
 #include "md.h"
 
@@ -22,31 +23,228 @@
 
 #define OTPW_DEBUG   1  /* output debugging messages via DEBUG_LOG macro */
 #define OTPW_NOLOCK  2  /* disable locking, never create or check OTPW_LOCK */
+#define OTPW_ENTRYLOCK 4 /* lock single entries, see otpw_lockdirsuffix */
+#define OTPW_OFDLOCK 8  /* lock single entries with fcntl() byte-range locks */
+#define OTPW_ARENA  16  /* use ch->arena, see struct challenge */
+#define OTPW_STATS  32  /* record timing in *ch->stats, see struct otpw_stats */
+
+/* upper limit for the number of entries in an OTPW file */
+
+#define OTPW_MAXENTRIES 9999
+
+/* upper limits for otpw_multi and for the length of a password */
+
+#define OTPW_MAXMULTI 10
+#define OTPW_MAXPWLEN 999
+
+/* maximum number of characters in a hash value (6 bits each) */
+#define OTPW_MAXHLEN ((MD_LEN * 8 - 4) / 6)
+
+/*
+ * Layout of the binary OTPW2 hash file format: a header of
+ * OTPW2_HDRLEN bytes, starting with otpw_magic2, is followed by a
+ * bitmap of used entries (bit i%8 of byte i/8 is set once entry i
+ * has been used) and then by the entries themselves. Each entry
+ * consists of challen characters of password number, immediately
+ * followed by hlen characters of base64 hash value, without any
+ * separator or line feed, such that entry i starts at byte
+ * OTPW2_RECORDS(entries) + i * (challen + hlen). A used entry is
+ * additionally overwritten with hyphens, just like in OTPW1. All
+ * header integers are stored as 32-bit little-endian values.
+ */
+
+#define OTPW2_HDRLEN        64
+#define OTPW2_BITMAPLEN(n)  (((n) + 7) / 8)
+#define OTPW2_RECORDS(n)    (OTPW2_HDRLEN + OTPW2_BITMAPLEN(n))
+
+struct otpw2_header {
+  int entries;          /* number of entries in OTPW file */
+  int challen;          /* number of characters in challenge string */
+  int hlen;             /* number of characters in hash value */
+  int pwlen;            /* number of characters in password */
+  int remaining;        /* number of remaining unused entries */
+  int next;             /* index of first unused entry (entries if none) */
+};
+
+/*
+ * With flag OTPW_STATS, otpw_prepare() clears *ch->stats, and then it
+ * and otpw_verify() add there the time spent in each phase of a
+ * login [ns, monotonic clock], and count some events, such that a
+ * slow login can be analyzed. Phase OTPW_PHASE_NSS is left to the
+ * caller, for the time of looking up the user, e.g. with getpwnam().
+ * Without the flag, recording costs only a test of ch->flags per
+ * phase, and defining OTPW_NO_STATS when compiling otpw.c removes
+ * even that.
+ */
+
+#define OTPW_PHASE_NSS     0  /* user database lookup (by caller) */
+#define OTPW_PHASE_CRED    1  /* switching effective uid/gid */
+#define OTPW_PHASE_OPEN    2  /* opening directory and OTPW file */
+#define OTPW_PHASE_PARSE   3  /* mapping file, checking header, scanning */
+#define OTPW_PHASE_LOCK    4  /* locking an entry, including retries */
+#define OTPW_PHASE_MULTI   5  /* drawing a multi challenge */
+#define OTPW_PHASE_HASH    6  /* hashing and comparing passwords */
+#define OTPW_PHASE_WRITE   7  /* overwriting used entries */
+#define OTPW_PHASE_RELEASE 8  /* removing lock, closing files */
+#define OTPW_PHASES        9
+
+struct otpw_stats {
+  unsigned long long ns[OTPW_PHASES];  /* time spent in each phase */
+  unsigned long long mark;  /* end of previous phase (internal) */
+  int lock_tries;           /* attempts to create a lock */
+  int locked;               /* entries found locked by other logins */
+  int stale_locks;          /* stale or corrupt locks removed */
+  int multi;                /* 1 if a multi challenge was issued */
+};
+
+/* names of the phases above, e.g. for log messages */
+extern const char *otpw_phase_name[OTPW_PHASES];
 
 /*
  * A data structure used by otpw_prepare to return the
- * selected challenge 
+ * selected challenge. It holds all its data inline, so a caller can
+ * keep it on the stack or inside another structure. What remains to
+ * be allocated temporarily during otpw_prepare() and otpw_verify()
+ * (mainly an array of ch->entries ints for a multi challenge) comes
+ * from the heap, unless the caller sets arena and arenasize and passes
+ * flag OTPW_ARENA, in which case it is taken from there as long as the
+ * arena is large enough (OTPW_MAXENTRIES * sizeof(int) bytes, plus 81
+ * bytes for each lock with OTPW_ENTRYLOCK or OTPW_OFDLOCK).
  */
 
 struct challenge {
   char challenge[81];   /* print this string before "Password:" */
-  int passwords;        /* number of req. passwords (0, 1, otpw_multi) */
+  int passwords;        /* number of req. passwords (0, 1, multi) */
   int locked;           /* flag, whether lock has been set */
   int entries;          /* number of entries in OTPW file */
   int pwlen;            /* number of characters in password */
   int challen;          /* number of characters in challenge string */
   int hlen;             /* number of characters in hash value */
   int remaining;        /* number of remaining unused OTPW file entries */
+  int format;           /* file format (1: OTPW1 text, 2: OTPW2 binary) */
+  int multi;            /* number of passwords in a multi challenge */
   uid_t uid;            /* effective uid for OTPW file/lock access */
   gid_t gid;            /* effective gid for OTPW file/lock access */
-  int *selection;       /* position of the otpw_multi requested passwords */
-  char **hash;          /* base64 hash values of the otpw_multi requested
-			   passwords, each otpw_hlen+1 bytes long */
+  int selection[OTPW_MAXMULTI];  /* position of the requested passwords */
+  unsigned char hash[OTPW_MAXMULTI * MD_LEN];
+                        /* hash values of the requested passwords,
+			   decoded by otpw_decode_hash(), MD_LEN bytes
+			   each */
   int flags;            /* 1 : debug messages, 2: no locking */
-  char *filename;       /* path of .otpw file (malloc'ed) */
-  char *lockfilename;   /* path of .optw.lock file (malloc'ed) */
+  char filename[PATH_MAX];      /* path of .otpw file */
+  char lockfilename[PATH_MAX];  /* path of .optw.lock file */
+  int nameoff;          /* offset of the names relative to dirfd in
+			   filename and lockfilename */
+  int dirfd;            /* open directory containing the .otpw file */
+  int fd;               /* open .otpw file */
+  void *arena;          /* optional scratch memory provided by caller */
+  size_t arenasize;     /* size of arena in bytes */
+  size_t arenaused;     /* bytes of arena currently in use */
+  struct otpw_stats *stats;  /* timing of phases (flag OTPW_STATS) */
+};
+
+/* buffer to hold the result of getpwnam_r() or getpwuid_r();
+ * essentially a struct passwd plus space for the strings
+ * that it might refer to */
+struct otpw_pwdbuf {
+  struct passwd pwd;
+  size_t buflen;
+  char buf[0]; /* actual size is buflen if allocated by otpw_malloc_pwdbuf() */
+};
+
+/*
+ * Configuration and cached lookups used by otpw_prepare_ctx() and
+ * otpw_verify_ctx(), in place of the global variables below. These
+ * functions only read *ctx, so several threads can serve concurrent
+ * logins with the same context, each with its own struct challenge.
+ */
+
+struct otpw_ctx {
+  const char *file;       /* see otpw_file */
+  const char *locksuffix; /* see otpw_locksuffix */
+  const char *lockdirsuffix; /* see otpw_lockdirsuffix */
+  int maxentrylocks;      /* see otpw_maxentrylocks */
+  int multi;              /* see otpw_multi */
+  int hlen;               /* see otpw_hlen */
+  double locktimeout;     /* see otpw_locktimeout */
+  struct otpw_pwdbuf *pseudouser;  /* see otpw_pseudouser */
+  int pseudouser_alloc;   /* flag, whether otpw_ctx_free() frees pseudouser */
+  int dirfd;              /* if >= 0, directory with the OTPW file (-1) */
+  struct otpw_metrics *metrics;  /* if non-NULL, counters to update (NULL) */
+};
+
+/* initialize *ctx from the global configuration variables */
+void otpw_ctx_init(struct otpw_ctx *ctx);
+
+/* look up the pseudouser as otpw_set_pseudouser() does, but cache the
+ * result in ctx->pseudouser instead of a global variable */
+int otpw_ctx_set_pseudouser(struct otpw_ctx *ctx);
+
+/* free what otpw_ctx_set_pseudouser() allocated */
+void otpw_ctx_free(struct otpw_ctx *ctx);
+
+/*
+ * otpw_prepare_ctx() normally changes the effective uid/gid to those
+ * of the owner of the OTPW file, opens the file and its directory
+ * and changes them back. otpw_verify_ctx() then only uses these open
+ * file descriptors, without changing uid/gid. If ctx->dirfd >= 0
+ * instead, then it is the already open directory that contains the
+ * OTPW file (the home directory of the pseudouser, or of the user
+ * logging in if there is no pseudouser), and otpw_prepare_ctx() will
+ * never change uid/gid either. A program that does not run with
+ * sufficient privileges can receive such a descriptor from a small
+ * privileged helper process via a Unix domain socket, using
+ * otpw_send_fd() and otpw_recv_fd(), which return -1 on error.
+ */
+int otpw_send_fd(int sock, int fd);
+int otpw_recv_fd(int sock);
+
+/*
+ * Counters and latency histograms of logins, kept in a small file that
+ * otpw_metrics_open() maps into shared memory, such that the many
+ * short-lived processes handling logins (e.g. sshd children with
+ * pam_otpw) can accumulate them, and otpw-stat can read them. If
+ * ctx->metrics points to it, otpw_prepare_ctx() and otpw_verify_ctx()
+ * update it with atomic additions, without any locks. Bucket k of a
+ * histogram counts the calls that took less than 2^k microseconds (but
+ * not less than half of that), except that the last bucket counts all
+ * slower ones, too.
+ */
+
+#define OTPW_METRICS_FILE    "/run/otpw.metrics"
+#define OTPW_METRICS_MAGIC   0x4d50544fU  /* "OTPM" */
+#define OTPW_METRICS_VERSION 1
+#define OTPW_METRICS_BUCKETS 24
+
+struct otpw_metrics {
+  unsigned magic;                    /* OTPW_METRICS_MAGIC */
+  unsigned version;                  /* OTPW_METRICS_VERSION */
+  unsigned long long prepares;       /* otpw_prepare_ctx() calls */
+  unsigned long long challenges;     /* ... that issued a challenge */
+  unsigned long long multi;          /* ... that asked for several passwords */
+  unsigned long long verifies[3];    /* otpw_verify_ctx() calls, by result
+					OTPW_OK, OTPW_WRONG, OTPW_ERROR */
+  unsigned long long stale_locks;    /* stale or corrupt locks removed */
+  unsigned long long write_failures; /* used entries not overwritten */
+  unsigned long long pam_success;    /* pam_otpw logins accepted, */
+  unsigned long long pam_failure;    /* ... refused (wrong password), */
+  unsigned long long pam_unavail;    /* ... not possible (no OTPW file, etc.) */
+  unsigned long long pam_unknown;    /* ... of unknown users */
+  unsigned long long prepare_us[OTPW_METRICS_BUCKETS];  /* histograms */
+  unsigned long long verify_us[OTPW_METRICS_BUCKETS];
+  unsigned long long prepare_ns;     /* sum of otpw_prepare_ctx() times */
+  unsigned long long verify_ns;      /* sum of otpw_verify_ctx() times */
 };
 
+/* add n to a counter in a struct otpw_metrics */
+#define OTPW_METRICS_ADD(counter, n) \
+  __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+
+/* map the metrics file at path, which is created if necessary when
+ * writable is non-zero; returns NULL (and sets errno) on error */
+struct otpw_metrics *otpw_metrics_open(const char *path, int writable);
+void otpw_metrics_close(struct otpw_metrics *m);
+
 /*
  * Call otpw_prepare() after the user has entered their login name and
  * has requested OTPW authentication, and after and you have retrieved
@@ -56,9 +254,15 @@ struct challenge {
  * password authentication is not possible at this time. Once you have
  * received the password, pass it to otpw_verify() along with the same
  * struct *ch used here.
+ *
+ * otpw_prepare_ctx() does the same with the configuration in *ctx
+ * instead of the global variables; pass the same ctx (or one with
+ * the same configuration) to otpw_verify_ctx() afterwards.
  */
 
 void otpw_prepare(struct challenge *ch, struct passwd *user, int flags);
+void otpw_prepare_ctx(const struct otpw_ctx *ctx, struct challenge *ch,
+		      struct passwd *user, int flags);
 
 /*
  * After the one-time password has been entered, call optw_verify() to
@@ -78,16 +282,106 @@ void otpw_prepare(struct challenge *ch, struct passwd *user, int flags);
  */
 
 int otpw_verify(struct challenge *ch, char *password);
+int otpw_verify_ctx(const struct otpw_ctx *ctx, struct challenge *ch,
+		    char *password);
 
-/* buffer to hold the result of getpwnam_r() or getpwuid_r();
- * essentially a struct passwd plus space for the strings
- * that it might refer to */
-struct otpw_pwdbuf {
-  struct passwd pwd;
-  size_t buflen;
-  char buf[0]; /* actual size is buflen if allocated by otpw_malloc_pwdbuf() */
+/*
+ * otpw_verify_many() checks n (prefix password, one-time password,
+ * hash value) tuples at once, e.g. the passwords of a multi challenge,
+ * or a large number of recorded submissions for an audit. It sets
+ * c[i].ok to 1 if the hash value of prefix followed by otpw matches
+ * the hash value that otpw_decode_hash() decoded from hlen characters
+ * of an OTPW file, and to 0 otherwise, and returns the number of
+ * matches. The comparison takes the same time whether or not (and
+ * where) the hash values differ. Up to MD_LANES hash
+ * values are computed in parallel, and if all tuples share the same
+ * prefix password, it is hashed only once.
+ */
+
+struct otpw_check {
+  const char *prefix;     /* prefix password */
+  size_t prefixlen;
+  const char *otpw;       /* one-time password (with confusables mapped) */
+  size_t otpwlen;
+  const unsigned char *hash;  /* expected hash value, see below */
+  int hlen;               /* number of characters it was decoded from */
+  int ok;                 /* result: 1 if matching, 0 otherwise */
 };
 
+int otpw_verify_many(struct otpw_check *c, int n);
+
+/*
+ * Decode the first chars (at most OTPW_MAXHLEN) characters of a hash
+ * value s in an OTPW file into its 6*chars bits at the start of the
+ * MD_LEN bytes at v. Returns 0 on success, or -1 if s contains an
+ * invalid character, in which case v will never match any hash value.
+ */
+int otpw_decode_hash(unsigned char *v, const char *s, int chars);
+
+/*
+ * A long-running server, such as otpwd, can keep the OTPW file of a
+ * user open and mapped in a struct otpw_table, and serve all logins of
+ * that user from it. The locks of pending challenges are then only
+ * kept in memory, in t->locked, much as with OTPW_ENTRYLOCK, and each
+ * verification writes the used entries back with pwrite() and
+ * fdatasync(). This is only safe if no other program handles logins
+ * for the same file at the same time.
+ *
+ * otpw_table_open() opens and maps the file, as otpw_prepare_ctx()
+ * would (returns 0 on success, -1 otherwise). otpw_table_changed()
+ * tells whether the file has since been replaced, e.g. by otpw-gen,
+ * in which case new logins should be served from a newly opened
+ * table, while pending ones can still be completed using the old one.
+ * otpw_table_prepare() and otpw_table_verify() take the place of
+ * otpw_prepare_ctx() and otpw_verify_ctx(), and otpw_table_release()
+ * abandons a pending challenge. A struct otpw_table must only be used
+ * by one thread at a time.
+ */
+
+struct otpw_view;
+
+struct otpw_table {
+  struct challenge file;   /* file opened by otpw_prepare_ctx() */
+  struct otpw_view *view;  /* mapping of the file */
+  unsigned char *locked;   /* per entry: locked by a pending challenge
+                              (1: single password, 2: multi challenge) */
+  int nlocked;             /* number of single password locks */
+  int remaining;           /* number of unused entries */
+  int next;                /* index of first unused entry (or entries) */
+  dev_t dev;               /* identity of file at time of opening */
+  ino_t ino;
+};
+
+int otpw_table_open(const struct otpw_ctx *ctx, struct otpw_table *t,
+		    struct passwd *user, int flags);
+int otpw_table_changed(struct otpw_table *t);
+void otpw_table_close(struct otpw_table *t);
+void otpw_table_prepare(const struct otpw_ctx *ctx, struct otpw_table *t,
+			struct challenge *ch, int flags);
+int otpw_table_verify(const struct otpw_ctx *ctx, struct otpw_table *t,
+		      struct challenge *ch, char *password);
+
+/*
+ * otpw_table_verify_batch() verifies the passwords entered for n
+ * challenges at once, which may come from different tables: it hashes
+ * them all together with md_batch(), and overwrites the used entries of
+ * each table with one pwritev() per run of adjacent entries, and a
+ * single fdatasync(). Each request gets the result that
+ * otpw_table_verify() would have returned, and its challenge is
+ * released. Returns the number of files written.
+ */
+
+struct otpw_verify_req {
+  struct otpw_table *t;    /* table that issued the challenge */
+  struct challenge *ch;    /* challenge from otpw_table_prepare() */
+  char *password;          /* entered password */
+  int result;              /* OTPW_OK, OTPW_WRONG or OTPW_ERROR */
+};
+
+int otpw_table_verify_batch(const struct otpw_ctx *ctx,
+			    struct otpw_verify_req *req, int n);
+void otpw_table_release(struct otpw_table *t, struct challenge *ch);
+
 /* some functions for dealing with struct pwdbuf */
 
 int otpw_getpwnam(const char *name, struct otpw_pwdbuf **result);
@@ -96,17 +390,28 @@ int otpw_getpwuid(uid_t uid, struct otpw_pwdbuf **result);
 /*
  * Check if the user otpw_autopseudouser exists and had a UID of not
  * higher than otpw_autopseudouser_maxuid. If so, malloc and set
- * otpw_pseudouser accordingly.
+ * *pseudouser accordingly.
+ */
+int otpw_set_pseudouser(struct otpw_pwdbuf **pseudouser);
+
+/*
+ * Convert between struct otpw2_header and the OTPW2_HDRLEN bytes that
+ * start an OTPW2 file. otpw2_unpack_header() returns 0 if buf starts
+ * with otpw_magic2, otherwise -1.
  */
-int otpw_set_pseudouser();
+void otpw2_pack_header(unsigned char *buf, const struct otpw2_header *h);
+int otpw2_unpack_header(struct otpw2_header *h, const unsigned char *buf);
 
 /* some global variables with configuration options */
 
 extern char *otpw_file;
 extern char *otpw_locksuffix;
+extern char *otpw_lockdirsuffix;
+extern int otpw_maxentrylocks;
 extern int otpw_multi;
 extern int otpw_hlen;
 extern char *otpw_magic;
+extern char *otpw_magic2;
 extern double otpw_locktimeout;
 extern struct otpw_pwdbuf *otpw_pseudouser;
 
@@ -0,0 +1,845 @@
+/*
+ * One-time password login server
+ *
+ * otpwd handles the OTPW logins delegated to it by pam_otpw (option
+ * daemon) over a local Unix domain socket (see otpwd.h). It keeps the
+ * OTPW file of each user open and mapped in memory after the first
+ * login, together with the locks of pending challenges, such that a
+ * login costs one round trip to otpwd instead of a user lookup, file
+ * parsing and file system locking in each sshd process.
+ *
+ * The main thread serves all connections with an edge-triggered epoll
+ * loop, and passes the requests on to a pool of worker threads (option
+ * -t). The users are divided into shards by a hash of their name, and
+ * all state of the users of a shard is only ever accessed by the one
+ * worker that currently processes the shard, such that no per-user
+ * locks are needed. Each shard has a home worker, but an idle worker
+ * steals ready shards from the others.
+ *
+ * Verification requests that arrive within a short window (option -w),
+ * or while the worker is still busy with the previous ones, are handled
+ * together by otpw_table_verify_batch(), which hashes all their
+ * passwords with md_batch() and writes the used entries of each file
+ * back, one pwritev() per run of adjacent entries, with a single
+ * fdatasync(), before any of these logins is accepted. This way, a
+ * burst of logins, e.g. after a network outage, costs far fewer system
+ * calls and disk flushes.
+ *
+ * Markus Kuhn <http://www.cl.cam.ac.uk/~mgk25/>
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <pwd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "otpw.h"
+#include "otpwd.h"
+
+/* maximum number of simultaneous client connections (option -c) */
+int max_clients = 1024;
+
+/* how long to collect verification requests, in milliseconds (option -w) */
+int window = 2;
+
+/* maximum number of verification requests handled together (option -b) */
+int max_batch = 64;
+
+/* number of worker threads (option -t, default: number of CPUs) */
+int nthreads = 0;
+
+/* number of shards per worker thread */
+#define SHARDS_PER_THREAD 8
+
+/* number of buckets in the hash table of users of each shard */
+#define USER_BUCKETS 256
+
+/* an OTPW file, shared by the user entry and all pending challenges */
+struct file {
+  struct otpw_table t;
+  int refs;                /* number of references to this file */
+};
+
+/* a user who has logged in before, and their current OTPW file */
+struct user {
+  struct user *next;       /* next user in same hash bucket */
+  struct file *file;       /* current OTPW file */
+  char name[1];            /* actual size is strlen(name) + 1 */
+};
+
+/* operations queued for a worker */
+#define OP_PREPARE  1      /* OTPWD_PREPARE request in c->m */
+#define OP_VERIFY   2      /* OTPWD_VERIFY request in c->m */
+#define OP_RELEASE  3      /* abandon pending challenge */
+
+/*
+ * A client connection, i.e. a login. While an operation is queued or
+ * processed (c->inflight), only the worker may access the fields after
+ * c->inflight, and otherwise only the main thread.
+ */
+struct client {
+  int fd;
+  int shard;               /* shard of user, or -1 before OTPWD_PREPARE */
+  int dead;                /* connection to be closed */
+  int inflight;            /* operation passed on to a worker */
+  struct client *next;     /* in shard queue or returned list */
+  int op;                  /* queued operation */
+  struct file *file;       /* file of pending challenge, or NULL */
+  struct challenge ch;     /* pending challenge */
+  struct otpwd_msg m;      /* request, then reply */
+};
+
+/* states of a shard */
+#define SHARD_IDLE     0   /* nothing queued */
+#define SHARD_WAITING  1   /* verifications queued, batching window open */
+#define SHARD_READY    2   /* in the ready list of a worker */
+#define SHARD_BUSY     3   /* being processed by a worker */
+
+struct shard {
+  struct user *users[USER_BUCKETS];  /* only accessed by processing worker */
+  struct client *head, *tail;        /* queued operations */
+  int queued;                        /* number of queued operations */
+  int state;
+  int home;                          /* worker that usually processes it */
+  struct timespec start;             /* arrival of first verification */
+  struct shard *next;                /* in ready list */
+};
+
+struct worker {
+  pthread_t thread;
+  int id;
+  struct shard *head, *tail;         /* shards ready to be processed */
+};
+
+/* statistics, see OTPWD_STATS */
+struct stats {
+  unsigned long connections;    /* accepted connections */
+  unsigned long prepares;       /* OTPWD_PREPARE requests */
+  unsigned long verifies;       /* OTPWD_VERIFY requests */
+  unsigned long batches;        /* calls of otpw_table_verify_batch() */
+  unsigned long files;          /* files written (pwritev + fdatasync) */
+  unsigned long steals;         /* shards processed by another worker */
+  unsigned long queue_max;      /* largest number of queued operations */
+  unsigned long batch_hist[8];  /* batch sizes 1, 2, 3-4, ..., 33-64, 65- */
+} stats;
+
+struct otpw_ctx ctx;
+int debug = 0;
+
+struct shard *shards;
+int nshards;
+struct worker *workers;
+
+/* protects the queues, the ready lists, returned and stats */
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t work = PTHREAD_COND_INITIALIZER;
+int queued = 0;                 /* number of queued operations */
+struct client *returned = NULL; /* clients whose operation is done */
+int wakefd;                     /* eventfd to signal returned clients */
+
+/*
+ * otpw_table_open() may change the effective uid of the whole process,
+ * so no other worker may access the file system at the same time.
+ */
+pthread_rwlock_t open_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/*
+ * The effective uid of the daemon at startup, which peer_ok() compares
+ * with, as geteuid() changes while a worker is in otpw_table_open().
+ */
+uid_t server_uid;
+
+int clients = 0;                /* number of open connections */
+struct client *closed = NULL;   /* to be freed after this epoll round */
+
+
+static unsigned hash_name(const char *name)
+{
+  unsigned h = 2166136261U;    /* FNV-1a */
+
+  while (*name)
+    h = (h ^ (unsigned char) *name++) * 16777619U;
+  return h;
+}
+
+
+static void file_unref(struct file *f)
+{
+  if (f && --f->refs == 0) {
+    otpw_table_close(&f->t);
+    free(f);
+  }
+}
+
+
+/*
+ * Find the current OTPW file of the named user, opening it if this is
+ * the first login since it was (re)created. Returns NULL if the user
+ * has no usable OTPW file, and then sets *nouser if the user database
+ * does not know the name. Only users with an open file are kept, such
+ * that unknown user names do not accumulate.
+ */
+static struct file *user_file(struct shard *s, const char *name, int flags,
+			      int *nouser)
+{
+  struct user **u, *n;
+  struct otpw_pwdbuf *pwd = NULL;
+  struct file *f;
+  int changed;
+
+  u = &s->users[hash_name(name) / nshards % USER_BUCKETS];
+  for (; *u; u = &(*u)->next)
+    if (!strcmp((*u)->name, name))
+      break;
+  if (*u) {
+    pthread_rwlock_rdlock(&open_lock);
+    changed = otpw_table_changed(&(*u)->file->t);
+    pthread_rwlock_unlock(&open_lock);
+    if (!changed)
+      return (*u)->file;
+  }
+
+  /* (re)open the file */
+  otpw_getpwnam(name, &pwd);
+  *nouser = !pwd;
+  f = pwd ? (struct file *) malloc(sizeof(struct file)) : NULL;
+  if (f) {
+    pthread_rwlock_wrlock(&open_lock);
+    if (otpw_table_open(&ctx, &f->t, &pwd->pwd, flags)) {
+      free(f);
+      f = NULL;
+    }
+    pthread_rwlock_unlock(&open_lock);
+  }
+  free(pwd);
+  if (f)
+    f->refs = 1;
+
+  if (*u) {
+    /* replace the old file, or forget the user if there is none now */
+    file_unref((*u)->file);
+    (*u)->file = f;
+    if (!f) {
+      n = *u;
+      *u = n->next;
+      free(n);
+    }
+  } else if (f) {
+    n = (struct user *) malloc(sizeof(struct user) + strlen(name));
+    if (!n) {
+      file_unref(f);
+      return NULL;
+    }
+    n->next = NULL;
+    n->file = f;
+    strcpy(n->name, name);
+    *u = n;
+  }
+  return f;
+}
+
+
+/* send a reply, without waiting, as the client must read it anyway */
+static void reply(struct client *c, struct otpwd_msg *m)
+{
+  if (send(c->fd, m, OTPWD_MSGLEN(m), MSG_DONTWAIT | MSG_NOSIGNAL) < 0 &&
+      debug)
+    fprintf(stderr, "otpwd: send(): %s\n", strerror(errno));
+}
+
+
+/* abandon any pending challenge */
+static void client_release(struct client *c)
+{
+  if (c->file) {
+    otpw_table_release(&c->file->t, &c->ch);
+    file_unref(c->file);
+    c->file = NULL;
+  }
+}
+
+
+/* put a shard into the ready list of its home worker (lock held) */
+static void make_ready(struct shard *s)
+{
+  struct worker *w = &workers[s->home];
+
+  s->state = SHARD_READY;
+  s->next = NULL;
+  if (w->tail)
+    w->tail->next = s;
+  else
+    w->head = s;
+  w->tail = s;
+  pthread_cond_signal(&work);
+}
+
+
+/* pass an operation of a client on to the worker of its shard */
+static void enqueue(struct client *c, int op)
+{
+  struct shard *s = &shards[c->shard];
+
+  c->op = op;
+  c->inflight = 1;
+  c->next = NULL;
+  pthread_mutex_lock(&lock);
+  if (s->tail)
+    s->tail->next = c;
+  else
+    s->head = c;
+  s->tail = c;
+  s->queued++;
+  if ((unsigned long) ++queued > stats.queue_max)
+    stats.queue_max = queued;
+  /* keep verifications waiting for the batching window, but nothing else */
+  if (s->state == SHARD_IDLE && op == OP_VERIFY && window > 0 &&
+      s->queued < max_batch) {
+    s->state = SHARD_WAITING;
+    clock_gettime(CLOCK_MONOTONIC, &s->start);
+  } else if (s->state == SHARD_IDLE ||
+	     (s->state == SHARD_WAITING &&
+	      (op != OP_VERIFY || s->queued >= max_batch)))
+    make_ready(s);
+  pthread_mutex_unlock(&lock);
+}
+
+
+static long elapsed_ms(const struct timespec *since)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - since->tv_sec) * 1000 +
+    (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+
+/*
+ * Make all shards ready whose batching window has ended, and return
+ * how many milliseconds remain until the next one ends (or -1).
+ */
+static int check_windows(void)
+{
+  int i, timeout = -1;
+  long left;
+
+  pthread_mutex_lock(&lock);
+  for (i = 0; i < nshards; i++)
+    if (shards[i].state == SHARD_WAITING) {
+      left = window - elapsed_ms(&shards[i].start);
+      if (left <= 0)
+	make_ready(&shards[i]);
+      else if (timeout < 0 || left < timeout)
+	timeout = left;
+    }
+  pthread_mutex_unlock(&lock);
+  return timeout;
+}
+
+
+/*
+ * Carry out the n operations queued in list for shard s, and reply to
+ * the clients. Returns the number of files written.
+ */
+static int process(struct shard *s, struct client *list, int n,
+		   int *batch)
+{
+  struct otpw_verify_req *req;
+  struct client *c, **vc;
+  struct file *f;
+  int i, nv = 0, files = 0, flags, nouser = 0;
+
+  req = (struct otpw_verify_req *) malloc(n * sizeof(*req));
+  vc = (struct client **) malloc(n * sizeof(*vc));
+  if (!req || !vc) {
+    fprintf(stderr, "otpwd: Memory allocation error!\n");
+    exit(1);
+  }
+  for (c = list; c; c = c->next) {
+    switch (c->op) {
+    case OP_PREPARE:
+      client_release(c);
+      flags = (c->m.flags & (OTPW_DEBUG | OTPW_NOLOCK)) |
+	(debug ? OTPW_DEBUG : 0);
+      f = user_file(s, c->m.data, flags, &nouser);
+      memset(&c->m, 0, OTPWD_HDRLEN + 1);
+      c->m.type = OTPWD_CHALLENGE;
+      if (!f && nouser)
+	c->m.result = OTPWD_NOUSER;
+      if (f) {
+	otpw_table_prepare(&ctx, &f->t, &c->ch, flags);
+	if (c->ch.passwords > 0) {
+	  c->file = f;
+	  f->refs++;
+	  strcpy(c->m.data, c->ch.challenge);
+	  c->m.passwords = c->ch.passwords;
+	}
+	c->m.remaining = f->t.remaining;
+	c->m.entries = f->t.file.entries;
+      }
+      reply(c, &c->m);
+      break;
+    case OP_VERIFY:
+      if (c->file) {
+	req[nv].t = &c->file->t;
+	req[nv].ch = &c->ch;
+	req[nv].password = c->m.data;
+	vc[nv++] = c;
+      } else {
+	memset(&c->m, 0, sizeof(c->m));
+	c->m.type = OTPWD_RESULT;
+	c->m.result = OTPW_ERROR;
+	reply(c, &c->m);
+      }
+      break;
+    case OP_RELEASE:
+      client_release(c);
+      break;
+    }
+  }
+
+  if (nv)
+    files = otpw_table_verify_batch(&ctx, req, nv);
+  for (i = 0; i < nv; i++) {
+    c = vc[i];
+    c->m.type = OTPWD_RESULT;
+    c->m.flags = 0;
+    c->m.result = req[i].result;
+    c->m.passwords = 0;
+    c->m.remaining = c->file->t.remaining;
+    c->m.entries = c->file->t.file.entries;
+    /* forget the password */
+    memset(c->m.data, 0, sizeof(c->m.data));
+    file_unref(c->file);
+    c->file = NULL;
+    reply(c, &c->m);
+  }
+  free(req);
+  free(vc);
+  *batch = nv;
+  return files;
+}
+
+
+/* take the next ready shard for worker w, stealing one if needed */
+static struct shard *next_shard(struct worker *w)
+{
+  struct worker *v = w;
+  struct shard *s;
+  int i;
+
+  if (!w->head)
+    for (i = 1; i < nthreads && !v->head; i++)
+      v = &workers[(w->id + i) % nthreads];
+  s = v->head;
+  if (s) {
+    v->head = s->next;
+    if (!v->head)
+      v->tail = NULL;
+    if (v != w)
+      stats.steals++;
+  }
+  return s;
+}
+
+
+static void *worker_main(void *arg)
+{
+  struct worker *w = (struct worker *) arg;
+  struct shard *s;
+  struct client *list, *c, *next;
+  uint64_t one = 1;
+  int n, k, files, batch;
+
+  pthread_mutex_lock(&lock);
+  for (;;) {
+    while (!(s = next_shard(w)))
+      pthread_cond_wait(&work, &lock);
+    s->state = SHARD_BUSY;
+    list = s->head;
+    n = s->queued;
+    s->head = s->tail = NULL;
+    s->queued = 0;
+    queued -= n;
+    pthread_mutex_unlock(&lock);
+
+    files = process(s, list, n, &batch);
+
+    pthread_mutex_lock(&lock);
+    if (batch) {
+      stats.batches++;
+      stats.files += files;
+      for (k = 0; k < 7 && (1 << k) < batch; k++) ;
+      stats.batch_hist[k]++;
+    }
+    /* hand the clients back to the main thread */
+    for (c = list; c; c = next) {
+      next = c->next;
+      c->next = returned;
+      returned = c;
+    }
+    /* what arrived in the meantime forms the next batch */
+    if (s->head)
+      make_ready(s);
+    else
+      s->state = SHARD_IDLE;
+    pthread_mutex_unlock(&lock);
+    if (write(wakefd, &one, sizeof(one)) < 0 && debug)
+      perror("otpwd: write(eventfd)");
+    pthread_mutex_lock(&lock);
+  }
+  return NULL;
+}
+
+
+static void client_close(struct client *c)
+{
+  close(c->fd);  /* which also removes it from the epoll set */
+  c->dead = 1;   /* ignore any further events for it in this round */
+  c->next = closed;
+  closed = c;
+  clients--;
+}
+
+
+/* close a connection, once the worker has released its challenge */
+static void client_kill(struct client *c)
+{
+  c->dead = 1;
+  if (c->inflight)
+    return;
+  if (c->file)
+    enqueue(c, OP_RELEASE);
+  else
+    client_close(c);
+}
+
+
+/* report the statistics */
+static void report_stats(struct otpwd_msg *m)
+{
+  char *p = m->data, *end = m->data + sizeof(m->data);
+  int k;
+
+  pthread_mutex_lock(&lock);
+  p += snprintf(p, end - p,
+		"threads %d\nshards %d\nclients %d\nconnections %lu\n"
+		"prepares %lu\nverifies %lu\nqueue_depth %d\nqueue_max %lu\n"
+		"batches %lu\nfiles %lu\nsteals %lu\n",
+		nthreads, nshards, clients, stats.connections,
+		stats.prepares, stats.verifies, queued, stats.queue_max,
+		stats.batches, stats.files, stats.steals);
+  for (k = 0; k < 7 && p < end; k++)
+    p += snprintf(p, end - p, "batch_size_le_%d %lu\n", 1 << k,
+		  stats.batch_hist[k]);
+  if (p < end)
+    snprintf(p, end - p, "batch_size_gt_64 %lu\n", stats.batch_hist[7]);
+  pthread_mutex_unlock(&lock);
+}
+
+
+/*
+ * Handle one message from a client. Returns 0 if the connection
+ * should stay open, -1 otherwise.
+ */
+static int handle(struct client *c, struct otpwd_msg *m, ssize_t len)
+{
+  int shard;
+
+  if (len < (ssize_t) OTPWD_HDRLEN + 1 ||
+      !memchr(m->data, 0, len - OTPWD_HDRLEN))
+    return -1;
+  switch (m->type) {
+  case OTPWD_PREPARE:
+    stats.prepares++;
+    /* a connection stays with the shard of its first user */
+    shard = hash_name(m->data) % nshards;
+    if (c->shard >= 0 && c->shard != shard)
+      return -1;
+    c->shard = shard;
+    memcpy(&c->m, m, len);
+    enqueue(c, OP_PREPARE);
+    return 0;
+  case OTPWD_VERIFY:
+    stats.verifies++;
+    if (c->shard < 0) {
+      memset(m, 0, sizeof(*m));
+      m->type = OTPWD_RESULT;
+      m->result = OTPW_ERROR;
+      reply(c, m);
+      return 0;
+    }
+    memcpy(&c->m, m, len);
+    enqueue(c, OP_VERIFY);
+    return 0;
+  case OTPWD_STATS:
+    memset(m, 0, sizeof(*m));
+    m->type = OTPWD_STATS;
+    report_stats(m);
+    reply(c, m);
+    return 0;
+  }
+  return -1;
+}
+
+
+/*
+ * Read the messages that have arrived from a client, up to the next
+ * one that has to be passed on to a worker.
+ */
+static void client_input(struct client *c)
+{
+  struct otpwd_msg m;
+  ssize_t len;
+
+  while (!c->dead && !c->inflight) {
+    len = recv(c->fd, &m, sizeof(m), MSG_DONTWAIT);
+    if (len < 0 && errno == EINTR)
+      continue;
+    if (len < 0 && errno == EAGAIN)
+      break;
+    if (len <= 0 || handle(c, &m, len)) {
+      client_kill(c);
+      break;
+    }
+  }
+  memset(&m, 0, sizeof(m));
+}
+
+
+/* continue with the clients whose operations the workers have finished */
+static void client_return(void)
+{
+  struct client *c, *next;
+  uint64_t count;
+
+  if (read(wakefd, &count, sizeof(count)) < 0 && errno != EAGAIN && debug)
+    perror("otpwd: read(eventfd)");
+  pthread_mutex_lock(&lock);
+  c = returned;
+  returned = NULL;
+  pthread_mutex_unlock(&lock);
+  for (; c; c = next) {
+    next = c->next;
+    c->inflight = 0;
+    if (c->dead) {
+      c->dead = 0;
+      client_kill(c);
+    } else
+      client_input(c);  /* the next request may be waiting already */
+  }
+}
+
+
+/* only accept connections from root and from our own uid */
+static int peer_ok(int fd)
+{
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len))
+    return 0;
+  return cred.uid == 0 || cred.uid == server_uid;
+}
+
+
+/* accept all new connections */
+static void accept_clients(int epfd, int lfd)
+{
+  struct epoll_event ev;
+  struct client *c;
+  int fd;
+
+  while ((fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0
+	 || errno == EINTR || errno == ECONNABORTED) {
+    if (fd < 0)
+      continue;
+    if (clients >= max_clients || !peer_ok(fd) ||
+	!(c = (struct client *) calloc(1, sizeof(struct client)))) {
+      close(fd);
+      continue;
+    }
+    c->fd = fd;
+    c->shard = -1;
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = c;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) {
+      close(fd);
+      free(c);
+      continue;
+    }
+    clients++;
+    stats.connections++;
+    /* messages may have arrived before we started to watch */
+    client_input(c);
+  }
+}
+
+
+/* query the statistics of a running server */
+static int query_stats(const char *path)
+{
+  struct sockaddr_un addr;
+  struct otpwd_msg m;
+  ssize_t len;
+  int fd;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  memset(&m, 0, sizeof(m));
+  m.type = OTPWD_STATS;
+  fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) ||
+      send(fd, &m, OTPWD_MSGLEN(&m), 0) < 0 ||
+      (len = recv(fd, &m, sizeof(m) - 1, 0)) < (ssize_t) OTPWD_HDRLEN) {
+    fprintf(stderr, "otpwd: can't query '%s", path);
+    perror("'");
+    return 1;
+  }
+  m.data[len - OTPWD_HDRLEN] = 0;
+  fputs(m.data, stdout);
+  return 0;
+}
+
+
+int main(int argc, char **argv)
+{
+  char *path = OTPWD_SOCKET;
+  struct sockaddr_un addr;
+  struct epoll_event ev, events[64];
+  struct client *c;
+  int i, n, epfd, lfd, timeout, query = 0;
+
+  for (i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-s") && i + 1 < argc)
+      path = argv[++i];
+    else if (!strcmp(argv[i], "-c") && i + 1 < argc)
+      max_clients = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-w") && i + 1 < argc)
+      window = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-b") && i + 1 < argc)
+      max_batch = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-t") && i + 1 < argc)
+      nthreads = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-d"))
+      debug = 1;
+    else if (!strcmp(argv[i], "-q"))
+      query = 1;
+    else {
+      fprintf(stderr, "usage: %s [-d] [-s socket] [-c max_clients] "
+	      "[-w window_ms] [-b max_batch] [-t threads]\n"
+	      "       %s -q [-s socket]\n", argv[0], argv[0]);
+      exit(1);
+    }
+  }
+  if (nthreads == 0)
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (max_clients < 1 || window < 0 || max_batch < 1 || nthreads < 1 ||
+      strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "otpwd: invalid arguments\n");
+    exit(1);
+  }
+  if (query)
+    return query_stats(path);
+
+  otpw_ctx_init(&ctx);
+  otpw_ctx_set_pseudouser(&ctx);
+  server_uid = geteuid();
+  signal(SIGPIPE, SIG_IGN);
+
+  /* create server socket, accessible only to root and our own uid */
+  lfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (lfd < 0) {
+    perror("otpwd: socket");
+    exit(1);
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  unlink(path);
+  umask(077);
+  if (bind(lfd, (struct sockaddr *) &addr, sizeof(addr)) ||
+      listen(lfd, SOMAXCONN)) {
+    fprintf(stderr, "otpwd: can't listen on '%s", path);
+    perror("'");
+    exit(1);
+  }
+
+  /* start the workers */
+  nshards = nthreads * SHARDS_PER_THREAD;
+  shards = (struct shard *) calloc(nshards, sizeof(struct shard));
+  workers = (struct worker *) calloc(nthreads, sizeof(struct worker));
+  if (!shards || !workers) {
+    fprintf(stderr, "otpwd: Memory allocation error!\n");
+    exit(1);
+  }
+  for (i = 0; i < nshards; i++)
+    shards[i].home = i % nthreads;
+  for (i = 0; i < nthreads; i++) {
+    workers[i].id = i;
+    if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i])) {
+      fprintf(stderr, "otpwd: can't start worker threads\n");
+      exit(1);
+    }
+  }
+
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  ev.events = EPOLLIN | EPOLLET;
+  ev.data.ptr = NULL;
+  if (epfd < 0 || wakefd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev)) {
+    perror("otpwd: epoll");
+    exit(1);
+  }
+  ev.data.ptr = &wakefd;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev)) {
+    perror("otpwd: epoll");
+    exit(1);
+  }
+
+  for (;;) {
+    /* wait for requests, but not beyond the end of a batching window */
+    timeout = check_windows();
+    n = epoll_wait(epfd, events, sizeof(events) / sizeof(events[0]),
+		   timeout);
+    if (n < 0 && errno != EINTR) {
+      perror("otpwd: epoll_wait");
+      exit(1);
+    }
+    for (i = 0; i < n; i++) {
+      c = (struct client *) events[i].data.ptr;
+      if (!c)
+	accept_clients(epfd, lfd);
+      else if (c == (struct client *) &wakefd)
+	client_return();
+      else if (!c->dead) {
+	if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+	  /* read what was sent before hanging up, then close */
+	  client_input(c);
+	  if (!c->dead)
+	    client_kill(c);
+	} else
+	  client_input(c);
+      }
+    }
+    while (closed) {
+      c = closed;
+      closed = c->next;
+      free(c);
+    }
+  }
+}
@@ -0,0 +1,51 @@
+/*
+ * Protocol between pam_otpw and the otpwd server
+ *
+ * Each login uses its own connection to the SOCK_SEQPACKET Unix domain
+ * socket of otpwd. The client sends an OTPWD_PREPARE message with the
+ * user name and receives an OTPWD_CHALLENGE message, then sends an
+ * OTPWD_VERIFY message with the entered password and receives an
+ * OTPWD_RESULT message. Closing the connection earlier abandons the
+ * challenge and releases its lock. An OTPWD_STATS request is answered
+ * with the server statistics as "name value" lines of text. All fields
+ * are in host byte order, and only the first OTPWD_MSGLEN() bytes of a
+ * message are sent.
+ *
+ * Markus Kuhn <http://www.cl.cam.ac.uk/~mgk25/>
+ */
+
+#ifndef OTPWD_H
+#define OTPWD_H
+
+#include <stddef.h>
+#include <string.h>
+
+/* default path of the server socket */
+#define OTPWD_SOCKET "/run/otpwd.sock"
+
+/* message types */
+
+#define OTPWD_PREPARE    1  /* client: data = user name */
+#define OTPWD_CHALLENGE  2  /* server: data = challenge ("" if none) */
+#define OTPWD_VERIFY     3  /* client: data = entered password */
+#define OTPWD_RESULT     4  /* server: result of verification */
+#define OTPWD_STATS      5  /* client: data = "", server: data = statistics */
+
+/* OTPWD_CHALLENGE result, if there is no challenge */
+#define OTPWD_NOUSER     1  /* user name unknown */
+
+struct otpwd_msg {
+  unsigned char type;   /* one of the message types above */
+  unsigned char flags;  /* OTPWD_PREPARE: OTPW_DEBUG, OTPW_NOLOCK */
+  short result;         /* OTPWD_RESULT: OTPW_OK, OTPW_WRONG or OTPW_ERROR,
+			   OTPWD_CHALLENGE: 0 or OTPWD_NOUSER */
+  int passwords;        /* OTPWD_CHALLENGE: number of requested passwords */
+  int remaining;        /* number of remaining unused entries */
+  int entries;          /* number of entries in OTPW file */
+  char data[4096];      /* '\0'-terminated string, see message types */
+};
+
+#define OTPWD_HDRLEN     offsetof(struct otpwd_msg, data)
+#define OTPWD_MSGLEN(m)  (OTPWD_HDRLEN + strlen((m)->data) + 1)
+
+#endif
@@ -21,17 +21,173 @@
 #include <unistd.h>
 #include <pwd.h>
 #include <syslog.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 
 #define PAM_SM_AUTH
 #define PAM_SM_SESSION
 #include <security/pam_modules.h>
 
 #include "otpw.h"
+#include "otpwd.h"
 
 #define D(a) if (debug) { a; }
 
 #define MODULE_NAME "pam_otpw"
 
+/* per-login state, kept as PAM data between authentication and session */
+struct login {
+  struct challenge ch;  /* must be first, see pam_sm_open_session() */
+  struct otpw_ctx ctx;  /* configuration, including pseudouser lookup */
+  int sock;             /* connection to otpwd (option daemon), or -1 */
+  struct otpw_stats stats;  /* timing of this login (option stats) */
+};
+
+/*
+ * Messages are sent to the syslog daemon over a datagram socket
+ * connected to LOG_PATH, which stays open for the lifetime of the
+ * process, instead of calling openlog() and closelog() around each
+ * message, which would also change the syslog settings of the
+ * application. With option asynclog, log_message() only formats each
+ * message into a free slot of log_ring[] (a bounded lock-free queue,
+ * where the seq field of each slot tells whether it is free or full)
+ * and a background thread sends it, such that a busy syslog daemon
+ * cannot delay a login (unless the ring is full, then they are sent
+ * directly).
+ */
+
+#define LOG_PATH   "/dev/log"
+#define LOG_MSGLEN 1024  /* maximum length of a syslog datagram */
+#define LOG_SLOTS  64    /* size of log_ring[], a power of two */
+
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static int log_fd = -1;  /* connection to LOG_PATH, guarded by log_lock */
+
+static struct {
+  unsigned seq;  /* == position: free, == position + 1: full */
+  int len;
+  char msg[LOG_MSGLEN];
+} log_ring[LOG_SLOTS];
+static unsigned log_head;  /* next position to fill */
+static unsigned log_tail;  /* next position to send (writer only) */
+static int log_async;      /* option asynclog was given */
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static pthread_t log_writer;
+static sem_t log_ready;    /* number of full slots */
+static pid_t log_pid;      /* process that runs log_writer, or 0 */
+static int log_stop;
+
+/* send one formatted message, reconnecting once if necessary */
+static int log_send(const char *msg, int len)
+{
+  struct sockaddr_un addr;
+  int tries, err = -1;
+
+  pthread_mutex_lock(&log_lock);
+  for (tries = 0; tries < 2 && err; tries++) {
+    if (log_fd < 0) {
+      log_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+      if (log_fd < 0)
+	break;
+      memset(&addr, 0, sizeof(addr));
+      addr.sun_family = AF_UNIX;
+      strcpy(addr.sun_path, LOG_PATH);
+      if (connect(log_fd, (struct sockaddr *) &addr, sizeof(addr))) {
+	close(log_fd);
+	log_fd = -1;
+	break;
+      }
+    }
+    err = send(log_fd, msg, len, MSG_NOSIGNAL) != len;
+    if (err && errno != EINTR) {
+      /* e.g. the syslog daemon has been restarted */
+      close(log_fd);
+      log_fd = -1;
+    }
+  }
+  pthread_mutex_unlock(&log_lock);
+  return err;
+}
+
+static void *log_write_loop(void *arg)
+{
+  unsigned pos;
+
+  (void) arg;
+  for (;;) {
+    while (sem_wait(&log_ready) && errno == EINTR)
+      ;
+    /* send all full slots in order (one may still be filled while
+     * later ones are already full) */
+    for (pos = log_tail;
+	 __atomic_load_n(&log_ring[pos % LOG_SLOTS].seq, __ATOMIC_ACQUIRE) ==
+	   pos + 1; pos++) {
+      log_send(log_ring[pos % LOG_SLOTS].msg, log_ring[pos % LOG_SLOTS].len);
+      __atomic_store_n(&log_ring[pos % LOG_SLOTS].seq, pos + LOG_SLOTS,
+		       __ATOMIC_RELEASE);
+    }
+    log_tail = pos;
+    if (__atomic_load_n(&log_stop, __ATOMIC_ACQUIRE))
+      break;
+  }
+  return NULL;
+}
+
+static void log_start(void)
+{
+  int i;
+
+  for (i = 0; i < LOG_SLOTS; i++)
+    log_ring[i].seq = i;
+  if (sem_init(&log_ready, 0, 0))
+    return;
+  if (pthread_create(&log_writer, NULL, log_write_loop, NULL) == 0)
+    __atomic_store_n(&log_pid, getpid(), __ATOMIC_RELEASE);
+}
+
+/* send what is still queued when pam_otpw.so is unloaded */
+static void __attribute__((destructor)) log_finish(void)
+{
+  if (log_pid && log_pid == getpid()) {
+    __atomic_store_n(&log_stop, 1, __ATOMIC_RELEASE);
+    sem_post(&log_ready);
+    pthread_join(log_writer, NULL);
+    log_pid = 0;
+  }
+  if (log_fd >= 0)
+    close(log_fd);
+  log_fd = -1;
+}
+
+/* copy a formatted message into the next free slot of log_ring[] */
+static int log_enqueue(const char *msg, int len)
+{
+  unsigned pos, seq;
+
+  pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+  for (;;) {
+    seq = __atomic_load_n(&log_ring[pos % LOG_SLOTS].seq, __ATOMIC_ACQUIRE);
+    if ((int) (seq - pos) < 0)
+      return -1;  /* ring full */
+    if (seq == pos &&
+	__atomic_compare_exchange_n(&log_head, &pos, pos + 1, 0,
+				    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      break;
+    if (seq != pos)
+      pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+  }
+  memcpy(log_ring[pos % LOG_SLOTS].msg, msg, len);
+  log_ring[pos % LOG_SLOTS].len = len;
+  __atomic_store_n(&log_ring[pos % LOG_SLOTS].seq, pos + 1, __ATOMIC_RELEASE);
+  sem_post(&log_ready);
+  return 0;
+}
+
 /*
  * Output logging information to syslog
  *
@@ -44,6 +200,12 @@ void log_message(int priority, pam_handle_t *pamh, const char *format, ...)
 {
   char *service = NULL;
   char logname[80];
+  char msg[LOG_MSGLEN];
+  char stamp[16];
+  struct tm tm;
+  time_t now;
+  int len, hdr;
+  int err = errno;  /* for %m in format */
   va_list args;
 
   if (pamh)
@@ -51,12 +213,62 @@ void log_message(int priority, pam_handle_t *pamh, const char *format, ...)
   if (!service)
     service = "";
   snprintf(logname, sizeof(logname), "%s(" MODULE_NAME ")", service);
-  
+
+  /* format "<PRI>Mmm dd hh:mm:ss TAG[PID]: MSG", as syslog() does */
+  now = time(NULL);
+  localtime_r(&now, &tm);
+  strftime(stamp, sizeof(stamp), "%b %e %H:%M:%S", &tm);
+  hdr = snprintf(msg, sizeof(msg), "<%d>%s %s[%d]: ",
+		 LOG_AUTH | LOG_PRI(priority), stamp, logname, (int) getpid());
   va_start(args, format);
-  openlog(logname, LOG_CONS | LOG_PID, LOG_AUTH);
-  vsyslog(priority, format, args);  /* from BSD, not POSIX */
+  errno = err;
+  len = vsnprintf(msg + hdr, sizeof(msg) - hdr, format, args);
   va_end(args);
-  closelog();
+  if (len < 0)
+    return;
+  len += hdr;
+  if (len >= (int) sizeof(msg))
+    len = sizeof(msg) - 1;
+
+  if (log_async) {
+    pthread_once(&log_once, log_start);
+    if (__atomic_load_n(&log_pid, __ATOMIC_ACQUIRE) == getpid()) {
+      /* (not in a child process forked since, which has no writer) */
+      if (log_enqueue(msg, len) == 0)
+	return;
+    }
+  }
+  if (log_send(msg, len)) {
+    /* no syslog socket at LOG_PATH, let syslog() find its way */
+    openlog(logname, LOG_CONS | LOG_PID, LOG_AUTH);
+    syslog(priority, "%s", msg + hdr);
+    closelog();
+  }
+}
+
+/* nanoseconds since some arbitrary point, for option stats */
+static unsigned long long now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* log the time spent in each phase of a login, option stats=PRIORITY */
+static void log_stats(int priority, pam_handle_t *pamh, const char *username,
+		      const struct otpw_stats *st, int result)
+{
+  char buf[LOG_MSGLEN];
+  int i, len = 0;
+
+  for (i = 0; i < OTPW_PHASES && len < (int) sizeof(buf); i++)
+    len += snprintf(buf + len, sizeof(buf) - len, " %s=%lluus",
+		    otpw_phase_name[i], (st->ns[i] + 500) / 1000);
+  log_message(priority, pamh, "stats for user %s, result %d:%s "
+	      "lock_tries=%d locked=%d stale_locks=%d multi=%d",
+	      username, result, buf, st->lock_tries, st->locked,
+	      st->stale_locks, st->multi);
 }
 
 /*
@@ -101,11 +313,15 @@ static int converse(pam_handle_t *pamh, int nargs,
  * to make sure that otpw_verify() gets a chance to remove locks */
 static void cleanup(pam_handle_t *pamh, void *data, int err)
 {
-  int debug = ((struct challenge *) data)->flags & OTPW_DEBUG;
+  struct login *login = data;
+  int debug = login->ch.flags & OTPW_DEBUG;
   D(log_message(LOG_DEBUG, pamh,"cleanup() called, data=%p, err=%d",
 		data, err));
-  if (((struct challenge *) data)->passwords)
-    otpw_verify((struct challenge *) data, "entryaborted");
+  if (login->sock >= 0)
+    close(login->sock);  /* otpwd then releases any pending challenge */
+  else if (login->ch.passwords)
+    otpw_verify_ctx(&login->ctx, &login->ch, "entryaborted");
+  otpw_ctx_free(&login->ctx);
   free(data);
 }
 
@@ -199,25 +415,285 @@ static int display_notice(pam_handle_t *pamh, int err, int debug,
   return PAM_SUCCESS;
 }
 
+/*
+ * Send a request to otpwd and receive its reply into the same buffer.
+ * Returns 0 on success, or -1 if otpwd can't be reached.
+ */
+static int otpwd_request(int sock, struct otpwd_msg *m, int type)
+{
+  ssize_t len;
+
+  if (send(sock, m, OTPWD_MSGLEN(m), MSG_NOSIGNAL) < 0)
+    return -1;
+  len = recv(sock, m, sizeof(*m), 0);
+  if (len < (ssize_t) OTPWD_HDRLEN + 1 || m->type != type)
+    return -1;
+  m->data[len - OTPWD_HDRLEN - 1] = 0;
+  return 0;
+}
 
-/* provided entry point for auth service */
-PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags,
-				   int argc, const char **argv)
+/*
+ * Connect to otpwd and ask it for a challenge, which is stored in
+ * login->ch like one from otpw_prepare_ctx(). Returns -1 if otpwd
+ * reports that the user is unknown, 0 otherwise.
+ */
+static int otpwd_prepare(pam_handle_t *pamh, struct login *login,
+			  const char *path, const char *username, int flags)
+{
+  struct sockaddr_un addr;
+  struct otpwd_msg m;
+  struct challenge *ch = &login->ch;
+
+  ch->flags = flags;
+  ch->entries = -1;
+  if (strlen(path) >= sizeof(addr.sun_path) ||
+      strlen(username) >= sizeof(m.data)) {
+    log_message(LOG_ERR, pamh, "invalid daemon socket or user name");
+    return 0;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  login->sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (login->sock < 0 ||
+      connect(login->sock, (struct sockaddr *) &addr, sizeof(addr))) {
+    log_message(LOG_ERR, pamh, "can't connect to otpwd at %s: %m", path);
+    return 0;
+  }
+  memset(&m, 0, OTPWD_HDRLEN);
+  m.type = OTPWD_PREPARE;
+  m.flags = flags & (OTPW_DEBUG | OTPW_NOLOCK);
+  strcpy(m.data, username);
+  if (otpwd_request(login->sock, &m, OTPWD_CHALLENGE)) {
+    log_message(LOG_ERR, pamh, "no challenge from otpwd: %m");
+    return 0;
+  }
+  if (m.result == OTPWD_NOUSER)
+    return -1;
+  if (m.passwords < 1 || strlen(m.data) >= sizeof(ch->challenge))
+    return 0;
+  strcpy(ch->challenge, m.data);
+  ch->remaining = m.remaining;
+  ch->entries = m.entries;
+  /* ch->passwords stays 0, as otpwd holds the challenge */
+  return 0;
+}
+
+/* let otpwd check the password entered for the challenge from it */
+static int otpwd_verify(struct login *login, const char *password)
+{
+  struct otpwd_msg m;
+  volatile char *p;
+  int result = OTPW_ERROR;
+
+  if (strlen(password) >= sizeof(m.data))
+    return OTPW_WRONG;
+  memset(&m, 0, OTPWD_HDRLEN);
+  m.type = OTPWD_VERIFY;
+  strcpy(m.data, password);
+  if (!otpwd_request(login->sock, &m, OTPWD_RESULT)) {
+    result = m.result;
+    login->ch.remaining = m.remaining;
+  }
+  for (p = m.data; p < m.data + sizeof(m.data); p++)
+    *p = 0;
+  return result;
+}
+
+
+/*
+ * Optional cache of password database lookups (option cache=SECONDS),
+ * for user databases such as LDAP or SSSD, where each getpwnam() is a
+ * directory query. It keeps the home directory, uid and gid of up to
+ * PWCACHE_SIZE recently seen users for the given number of seconds,
+ * and looks up the pseudouser only once for the lifetime of the
+ * process. Everything is forgotten as soon as one of nss_files[]
+ * changes.
+ */
+
+#define PWCACHE_SIZE 64
+
+static const char *nss_files[] = { "/etc/nsswitch.conf", "/etc/passwd" };
+#define NSS_FILES (sizeof(nss_files) / sizeof(nss_files[0]))
+
+static pthread_mutex_t pwcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+  struct otpw_pwdbuf *pw;  /* copy of a password database entry */
+  time_t expires;
+} pwcache[PWCACHE_SIZE];
+static struct otpw_pwdbuf *pwcache_pseudouser;
+static int pwcache_pseudouser_known;  /* pwcache_pseudouser looked up */
+static struct stat nss_stat[NSS_FILES];  /* state of nss_files[] */
+
+/* copy the parts of *pw that OTPW needs into a malloc'ed otpw_pwdbuf */
+static struct otpw_pwdbuf *pwdbuf_dup(const struct passwd *pw)
+{
+  struct otpw_pwdbuf *p;
+  size_t nl = strlen(pw->pw_name) + 1, dl = strlen(pw->pw_dir) + 1;
+
+  p = (struct otpw_pwdbuf *) malloc(sizeof(struct otpw_pwdbuf) + nl + dl);
+  if (!p)
+    return NULL;
+  p->buflen = nl + dl;
+  memset(&p->pwd, 0, sizeof(p->pwd));
+  p->pwd.pw_name = memcpy(p->buf, pw->pw_name, nl);
+  p->pwd.pw_dir = memcpy(p->buf + nl, pw->pw_dir, dl);
+  p->pwd.pw_passwd = p->pwd.pw_gecos = p->pwd.pw_shell = p->buf + nl - 1;
+  p->pwd.pw_uid = pw->pw_uid;
+  p->pwd.pw_gid = pw->pw_gid;
+  return p;
+}
+
+/* empty the cache if nsswitch.conf or the passwd file have changed
+ * since the last call (call with pwcache_lock held) */
+static void pwcache_check(void)
+{
+  struct stat st;
+  unsigned i;
+  int changed = 0;
+
+  for (i = 0; i < NSS_FILES; i++) {
+    if (stat(nss_files[i], &st))
+      memset(&st, 0, sizeof(st));
+    if (st.st_ino != nss_stat[i].st_ino || st.st_dev != nss_stat[i].st_dev ||
+	st.st_size != nss_stat[i].st_size ||
+	st.st_mtim.tv_sec != nss_stat[i].st_mtim.tv_sec ||
+	st.st_mtim.tv_nsec != nss_stat[i].st_mtim.tv_nsec) {
+      nss_stat[i] = st;
+      changed = 1;
+    }
+  }
+  if (!changed)
+    return;
+  for (i = 0; i < PWCACHE_SIZE; i++) {
+    free(pwcache[i].pw);
+    pwcache[i].pw = NULL;
+  }
+  free(pwcache_pseudouser);
+  pwcache_pseudouser = NULL;
+  pwcache_pseudouser_known = 0;
+}
+
+/* otpw_getpwnam(), answered from the cache if possible */
+static void cached_getpwnam(const char *name, int ttl,
+			    struct otpw_pwdbuf **user)
+{
+  unsigned h = 0;
+  const char *s;
+  time_t now = time(NULL);
+
+  for (s = name; *s; s++)
+    h = h * 31 + (unsigned char) *s;
+  h %= PWCACHE_SIZE;
+  *user = NULL;
+  pthread_mutex_lock(&pwcache_lock);
+  pwcache_check();
+  if (pwcache[h].pw && now < pwcache[h].expires &&
+      !strcmp(pwcache[h].pw->pwd.pw_name, name))
+    *user = pwdbuf_dup(&pwcache[h].pw->pwd);
+  pthread_mutex_unlock(&pwcache_lock);
+  if (*user)
+    return;
+
+  /* not cached (or expired), so ask NSS without holding the lock */
+  otpw_getpwnam(name, user);
+  if (!*user)
+    return;
+  pthread_mutex_lock(&pwcache_lock);
+  free(pwcache[h].pw);
+  pwcache[h].pw = pwdbuf_dup(&(*user)->pwd);
+  pwcache[h].expires = now + ttl;
+  pthread_mutex_unlock(&pwcache_lock);
+}
+
+/* otpw_ctx_set_pseudouser(), but looked up only once */
+static void cached_pseudouser(struct otpw_ctx *ctx)
+{
+  pthread_mutex_lock(&pwcache_lock);
+  pwcache_check();
+  if (!pwcache_pseudouser_known) {
+    otpw_set_pseudouser(&pwcache_pseudouser);
+    pwcache_pseudouser_known = 1;
+  }
+  /* each login gets its own copy, which otpw_ctx_free() frees, as the
+   * cached one may go away if nss_files[] change in the meantime */
+  if (pwcache_pseudouser) {
+    ctx->pseudouser = pwdbuf_dup(&pwcache_pseudouser->pwd);
+    ctx->pseudouser_alloc = ctx->pseudouser != NULL;
+  }
+  pthread_mutex_unlock(&pwcache_lock);
+}
+
+/*
+ * Shared metrics file (option metrics[=FILE]), mapped only once per
+ * process, where pam_sm_authenticate() counts its results and the
+ * library its calls (see struct otpw_metrics)
+ */
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct otpw_metrics *metrics_map;
+static int metrics_failed;  /* do not try (and complain) again */
+
+static struct otpw_metrics *open_metrics(pam_handle_t *pamh,
+					 const char *path)
+{
+  struct otpw_metrics *m;
+
+  pthread_mutex_lock(&metrics_lock);
+  if (!metrics_map && !metrics_failed) {
+    metrics_map = otpw_metrics_open(path, 1);
+    if (!metrics_map) {
+      log_message(LOG_WARNING, pamh, "can't open metrics file %s: %m", path);
+      metrics_failed = 1;
+    }
+  }
+  m = metrics_map;
+  pthread_mutex_unlock(&metrics_lock);
+  return m;
+}
+
+
+static int authenticate(pam_handle_t *pamh, int flags,
+			int argc, const char **argv,
+			struct otpw_metrics *metrics)
 {
   int retval;
   const char *username;
   char *password;
-  struct otpw_pwdbuf *user;
-  struct challenge *ch = NULL;
-  int i, debug = 0, otpw_flags = 0;
+  struct otpw_pwdbuf *user = NULL;
+  const char *daemon = NULL;
+  struct login *login = NULL;
+  struct challenge *ch;
+  int i, debug = 0, otpw_flags = 0, cache = 0, stats = -1;
+  unsigned long long nss_ns = 0;
 
   /* parse option flags */
   for (i = 0; i < argc; i++) {
     if (!strcmp(argv[i], "debug")) {
       debug = 1;
       otpw_flags |= OTPW_DEBUG;
+    } else if (!strcmp(argv[i], "asynclog")) {
+      log_async = 1;
     } else if (!strcmp(argv[i], "nolock")) {
       otpw_flags |= OTPW_NOLOCK;
+    } else if (!strcmp(argv[i], "entrylock")) {
+      otpw_flags |= OTPW_ENTRYLOCK;
+    } else if (!strcmp(argv[i], "ofdlock")) {
+      otpw_flags |= OTPW_OFDLOCK;
+    } else if (!strcmp(argv[i], "daemon")) {
+      daemon = OTPWD_SOCKET;
+    } else if (!strncmp(argv[i], "daemon=", 7)) {
+      daemon = argv[i] + 7;
+    } else if (!strncmp(argv[i], "cache=", 6)) {
+      cache = atoi(argv[i] + 6);
+    } else if (!strcmp(argv[i], "stats")) {
+      stats = LOG_INFO;
+    } else if (!strncmp(argv[i], "stats=", 6)) {
+      if (!strcmp(argv[i] + 6, "debug"))
+	stats = LOG_DEBUG;
+      else if (!strcmp(argv[i] + 6, "notice"))
+	stats = LOG_NOTICE;
+      else
+	stats = LOG_INFO;
     }
   }
 
@@ -238,9 +714,17 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags,
   D(log_message(LOG_DEBUG, pamh, "uid=%d, euid=%d, gid=%d, egid=%d",
 		getuid(), geteuid(), getgid(), getegid()));
 
-  /* consult POSIX password database (to find homedir, etc.) */
-  otpw_getpwnam(username, &user);
-  if (!user) {
+  /* consult POSIX password database (to find homedir, etc.),
+   * unless otpwd does that for us */
+  if (stats >= 0)
+    nss_ns = now_ns();
+  if (!daemon && cache > 0)
+    cached_getpwnam(username, cache, &user);
+  else if (!daemon)
+    otpw_getpwnam(username, &user);
+  if (stats >= 0)
+    nss_ns = now_ns() - nss_ns;
+  if (!daemon && !user) {
     log_message(LOG_NOTICE, pamh, "username not found");
     return PAM_USER_UNKNOWN;
   }
@@ -250,30 +734,52 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags,
    * even if the connection is aborted while we are in get_response()
    * or something else goes wrong.
    */
-  ch = calloc(1, sizeof(struct challenge));
-  if (!ch)
+  login = calloc(1, sizeof(struct login));
+  if (!login) {
+    free(user);
     return PAM_AUTHINFO_UNAVAIL;
-  retval = pam_set_data(pamh, MODULE_NAME":ch", ch, cleanup);
+  }
+  ch = &login->ch;
+  login->sock = -1;
+  otpw_ctx_init(&login->ctx);
+  login->ctx.metrics = metrics;
+  retval = pam_set_data(pamh, MODULE_NAME":ch", login, cleanup);
   if (retval != PAM_SUCCESS) {
     log_message(LOG_ERR, pamh, "pam_set_data() failed");
+    free(login);
+    free(user);
     return PAM_AUTHINFO_UNAVAIL;
   }
 
-  /* check whether a pseudo-user for owning OTPW files exist */
-  otpw_set_pseudouser(&otpw_pseudouser);
-
-  /* prepare OTPW challenge */
-  otpw_prepare(ch, &user->pwd, otpw_flags);
-  free(user);
-  if (otpw_pseudouser) {
-    free(otpw_pseudouser);
-    otpw_pseudouser = NULL;
+  if (daemon) {
+    /* ask otpwd for an OTPW challenge */
+    if (otpwd_prepare(pamh, login, daemon, username, otpw_flags)) {
+      log_message(LOG_NOTICE, pamh, "username not found");
+      return PAM_USER_UNKNOWN;
+    }
+  } else {
+    /* check whether a pseudo-user for owning OTPW files exist */
+    if (cache > 0)
+      cached_pseudouser(&login->ctx);
+    else
+      otpw_ctx_set_pseudouser(&login->ctx);
+
+    /* prepare OTPW challenge */
+    if (stats >= 0) {
+      ch->stats = &login->stats;
+      otpw_flags |= OTPW_STATS;
+    }
+    otpw_prepare_ctx(&login->ctx, ch, &user->pwd, otpw_flags);
+    login->stats.ns[OTPW_PHASE_NSS] = nss_ns;
+    free(user);
   }
 
   D(log_message(LOG_DEBUG, pamh, "challenge: %s", ch->challenge));
-  if (ch->passwords < 1) {
+  if (!ch->challenge[0]) {
     /* it seems OTPW might not have been set up or has exhausted keys,
        perhaps explain here in info msg how to "man otpw-gen" */
+    if (ch->flags & OTPW_STATS)
+      log_stats(stats, pamh, username, &login->stats, OTPW_ERROR);
     log_message(LOG_NOTICE, pamh, "OTPW not set up for user %s", username);
     return PAM_AUTHINFO_UNAVAIL;
   }
@@ -300,7 +806,12 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags,
   }
    
   /* verify response */
-  retval = otpw_verify(ch, password);
+  if (daemon)
+    retval = otpwd_verify(login, password);
+  else
+    retval = otpw_verify_ctx(&login->ctx, ch, password);
+  if (ch->flags & OTPW_STATS)
+    log_stats(stats, pamh, username, &login->stats, retval);
   if (retval == OTPW_OK) {
     D(log_message(LOG_DEBUG, pamh, "password matches"));
     return PAM_SUCCESS;
@@ -313,6 +824,35 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags,
   return PAM_AUTHINFO_UNAVAIL;
 }
 
+/* provided entry point for auth service */
+PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags,
+				   int argc, const char **argv)
+{
+  struct otpw_metrics *m = NULL;
+  int i, retval;
+
+  for (i = 0; i < argc; i++) {
+    if (!strcmp(argv[i], "metrics"))
+      m = open_metrics(pamh, OTPW_METRICS_FILE);
+    else if (!strncmp(argv[i], "metrics=", 8))
+      m = open_metrics(pamh, argv[i] + 8);
+  }
+
+  retval = authenticate(pamh, flags, argc, argv, m);
+
+  if (m) {
+    if (retval == PAM_SUCCESS)
+      OTPW_METRICS_ADD(m->pam_success, 1);
+    else if (retval == PAM_AUTH_ERR)
+      OTPW_METRICS_ADD(m->pam_failure, 1);
+    else if (retval == PAM_USER_UNKNOWN)
+      OTPW_METRICS_ADD(m->pam_unknown, 1);
+    else
+      OTPW_METRICS_ADD(m->pam_unavail, 1);
+  }
+  return retval;
+}
+
 /* another expected entry point */
 PAM_EXTERN int pam_sm_setcred(pam_handle_t *pamh, int flags, 
 			      int argc, const char **argv)
@@ -339,6 +879,8 @@ PAM_EXTERN int pam_sm_open_session(pam_handle_t *pamh, int flags,
   for (i = 0; i < argc; i++) {
     if (!strcmp(argv[i], "debug"))
       debug = 1;
+    else if (!strcmp(argv[i], "asynclog"))
+      log_async = 1;
   }
 
   D(log_message(LOG_DEBUG, pamh, "pam_sm_open_session called, flags=%d",
@@ -0,0 +1,419 @@
+/*
+ * Encoding of random bit strings as printable one-time passwords
+ *
+ * Markus Kuhn <http://www.cl.cam.ac.uk/~mgk25/>
+ */
+
+#include <string.h>
+#include <assert.h>
+#include "pwgen.h"
+
+
+/*
+ * A list of common English four letter words. It has not been checked
+ * particularly well for being free of rude words or trademarks; users
+ * are meant to keep them secret anyway.
+ */
+
+static const char word[2048][4] = {
+  "abel","able","ably","acer","aces","acet","ache","acid","acne","acre",
+  "acts","adam","adds","aden","afar","aged","ages","aide","aids","aims",
+  "airs","airy","ajar","akin","alan","alas","alec","ales","alex","alix",
+  "ally","alma","alps","also","alto","amen","ames","amid","amis","amos",
+  "amps","anal","andy","anew","ange","angy","anna","anne","ante","anti",
+  "ants","anus","anya","aoun","apes","apex","apse","arab","arch","arcs",
+  "ards","area","aria","arid","arms","army","arts","asda","asia","asks",
+  "atom","atop","audi","aung","aunt","aura","auto","avid","aviv","avon",
+  "away","awry","axed","axes","axis","axle","aziz","baba","babe","baby",
+  "bach","back","bade","bags","bail","bait","bake","baku","bald","bale",
+  "bali","ball","balm","band","bang","bank","bans","bare","bark","barn",
+  "barr","bars","bart","base","bash","bass","bath","bats","bays","bcci",
+  "bdda","bead","beak","beam","bean","bear","beat","beck","bede","beds",
+  "beef","been","beep","beer","bees","begs","bell","belt","bend","benn",
+  "bent","berg","bert","best","beta","beth","bets","bias","bids","biff",
+  "bike","bile","bill","bind","bins","bird","birk","birt","bite","bits",
+  "blah","blew","blip","blob","bloc","blot","blow","blue","blur","boar",
+  "boat","bodo","body","boer","bogs","boil","bold","bolt","bomb","bond",
+  "bone","bonn","bono","bony","book","boom","boon","boot","bore","borg",
+  "born","boro","boss","both","bout","bowe","bowl","bows","boyd","boys",
+  "brad","bran","bras","brat","bray","bred","brew","brim","brom","bros",
+  "brow","buck","buds","buff","bugs","bulb","bulk","bull","bump","bums",
+  "bunk","buns","buoy","burn","burr","burt","bury","bush","bust","busy",
+  "butt","buys","buzz","byre","byte","cabs","cafe","cage","cain","cake",
+  "calf","call","calm","came","camp","cane","cans","cape","caps","capt",
+  "cara","card","care","carl","caro","carp","carr","cars","cart","casa",
+  "case","cash","cask","cast","cats","cave","cdna","cegb","cell","cent",
+  "cert","chad","chan","chap","chas","chat","chef","chen","cher","chew",
+  "chic","chin","chip","chop","chub","chum","cite","city","clad","clan",
+  "claw","clay","cleo","clio","clip","club","clue","cnaa","cnut","coal",
+  "coat","coax","coca","code","cohn","coil","coin","coke","cola","cold",
+  "cole","coli","colt","coma","comb","come","comp","cone","cons","cook",
+  "cool","cope","cops","copy","cord","core","cork","corn","corp","cose",
+  "cost","cosy","cots","coun","coup","cove","cows","cpre","cpsu","cpus",
+  "crab","crag","crap","cray","creb","crew","crim","crop","crow","crux",
+  "cruz","csce","cuba","cube","cubs","cues","cuff","cult","cunt","cups",
+  "curb","curd","cure","curl","curt","cute","cuts","daak","dada","dads",
+  "daft","dahl","dais","dale","daly","dame","damn","damp","dams","dana",
+  "dane","dank","dare","dark","dart","dash","data","date","dave","davy",
+  "dawn","days","daze","dead","deaf","deal","dean","dear","debt","deck",
+  "deed","deep","deer","deft","defy","dell","demo","deng","dent","deny",
+  "dept","desk","dial","dice","dick","died","dies","diet","digs","dine",
+  "ding","dino","dint","dire","dirk","dirt","disc","dish","disk","dive",
+  "dock","dodd","does","dogs","dole","doll","dome","done","dons","doom",
+  "door","dope","dora","dose","doth","dots","doug","dour","dove","dowd",
+  "down","drab","drag","draw","drew","drip","drop","drug","drum","dual",
+  "duck","duct","duel","dues","duet","duff","duke","dull","duly","duma",
+  "dumb","dump","dune","dung","dunn","dusk","dust","duty","dyer","dyes",
+  "dyke","each","earl","earn","ears","ease","east","easy","eats","echo",
+  "ecsc","eddy","eden","edge","edgy","edie","edit","edna","edta","eels",
+  "efta","egan","eggs","egon","egos","eire","ella","else","emil","emit",
+  "emma","ends","enid","envy","epic","ercp","eric","erik","esau","esrc",
+  "esso","eton","euro","evan","even","ever","evil","ewen","ewes","exam",
+  "exit","exon","expo","eyed","eyes","eyre","ezra","face","fact","fade",
+  "fads","fags","fail","fair","fake","fall","fame","fand","fans","fare",
+  "farm","farr","fast","fate","fats","fawn","faye","fear","feat","feed",
+  "feel","fees","feet","fell","felt","fend","fenn","fens","fern","fete",
+  "feud","fiat","fife","figs","fiji","file","fill","film","find","fine",
+  "finn","fins","fire","firm","fish","fist","fits","five","flag","flak",
+  "flap","flat","flaw","flea","fled","flee","flew","flex","flip","flop",
+  "flow","floy","flue","flux","foal","foam","foci","foes","foil","fold",
+  "folk","fond","font","food","fool","foot","ford","fore","fork","form",
+  "fort","foul","four","fowl","fran","frau","fray","fred","free","fret",
+  "frog","from","ftse","fuel","fuji","full","fund","funk","furs","fury",
+  "fuse","fuss","fyfe","gael","gail","gain","gait","gala","gale","gall",
+  "game","gang","gaol","gaps","garb","gary","gash","gasp","gate","gatt",
+  "gaul","gave","gays","gaza","gaze","gcse","gear","gels","gems","gene",
+  "gens","gent","germ","gets","gift","gigs","gill","gilt","gina","girl",
+  "gist","give","glad","glee","glen","glow","glue","glum","goal","goat",
+  "gods","goes","goff","gogh","gold","golf","gone","good","gore","gory",
+  "gosh","gown","grab","graf","gram","gran","gray","greg","grew","grey",
+  "grid","grim","grin","grip","grit","grow","grub","guil","gulf","gull",
+  "gulp","gums","gunn","guns","guru","gust","guts","guys","gwen","hack",
+  "haig","hail","hair","hale","half","hall","halo","halt","hams","hand",
+  "hang","hank","hans","hard","hare","hari","harm","harp","hart","hash",
+  "hate","hath","hats","hatt","haul","have","hawk","haze","hazy","head",
+  "heal","heap","hear","heat","heck","heed","heel","heir","hela","held",
+  "hell","helm","help","hens","herb","herd","here","hero","herr","hers",
+  "hess","hibs","hick","hide","high","hike","hill","hilt","hind","hint",
+  "hips","hire","hiss","hits","hive","hiya","hmso","hoax","hogg","hold",
+  "hole","holt","holy","home","hong","hons","hood","hoof","hook","hoop",
+  "hope","hops","horn","hose","host","hour","hove","howe","howl","hrun",
+  "hues","huge","hugh","hugo","hulk","hull","hume","hump","hung","hunt",
+  "hurd","hurt","hush","huts","hyde","hype","iaea","iago","iain","ibid",
+  "iboa","iced","icon","idea","idle","idly","idol","igor","ills","inca",
+  "ince","inch","info","inns","insp","into","iona","ions","iowa","iran",
+  "iraq","iris","iron","isis","isle","itch","item","ivan","ives","ivor",
+  "jack","jade","jail","jake","jams","jane","jars","java","jaws","jazz",
+  "jean","jeep","jeff","jerk","jess","jest","jets","jett","jews","jill",
+  "jimi","joan","jobs","jock","joel","joey","john","join","joke","jolt",
+  "jose","josh","joys","juan","judd","jude","judi","judo","judy","jugs",
+  "july","jump","june","jung","junk","jury","just","kahn","kane","kant",
+  "karl","karr","kate","kath","katy","katz","kaye","keel","keen","keep",
+  "kemp","kent","kept","kerb","kerr","keys","khan","kick","kidd","kids",
+  "kiev","kiff","kill","kiln","kilo","kilt","kind","king","kirk","kiss",
+  "kite","kits","kiwi","knee","knew","knit","knob","knot","know","knox",
+  "koch","kohl","kong","kuhn","kurt","kyle","kyte","labs","lace","lack",
+  "lacy","lads","lady","laid","lain","lair","lais","lake","lama","lamb",
+  "lame","lamp","land","lane","lang","laos","laps","lard","lark","lass",
+  "last","late","lava","lawn","laws","lays","lazy","lead","leaf","leak",
+  "lean","leap","lear","leas","lech","lees","left","legs","lend","lens",
+  "lent","leon","less","lest","lets","levi","levy","leys","liam","liar",
+  "lice","lick","lids","lied","lien","lies","life","lift","like","lili",
+  "lily","lima","limb","lime","limp","lina","line","ling","link","lino",
+  "lion","lips","lira","lire","lisa","list","live","liza","load","loaf",
+  "loan","lobe","loch","lock","loco","loft","logo","logs","lois","lone",
+  "long","look","loom","loop","loos","loot","lord","lore","lori","lose",
+  "loss","lost","lots","loud","love","lowe","ltte","luce","luch","luck",
+  "lucy","ludo","luis","luke","lull","lump","lung","lure","lush","lust",
+  "lute","lyle","lyon","mabs","mace","mach","mack","made","maid","mail",
+  "main","mait","make","mala","male","mali","mall","malt","mama","mane",
+  "mann","mans","manx","many","maps","marc","mare","mark","marr","mars",
+  "marx","mary","mash","mask","mass","mast","mate","mats","matt","maud",
+  "mayo","maze","mead","meal","mean","meat","meek","meet","mega","melt",
+  "memo","mend","mens","menu","mere","mesh","mess","mice","mick","midi",
+  "mike","mild","mile","milk","mill","mime","mind","mine","minh","mini",
+  "mink","mins","mint","mips","mira","mire","miss","mist","mite","moan",
+  "moat","mobs","moby","mock","mode","modi","mold","mole","mona","monk",
+  "mono","mont","mood","moon","moor","moot","more","mori","moss","most",
+  "moth","mott","move","mrna","much","muck","mugs","muir","mule","mull",
+  "mums","muon","muse","must","mute","myra","nacl","naff","nail","name",
+  "nana","nape","nasa","nash","nato","nave","navy","neal","near","neat",
+  "neck","need","neil","nell","neon","nero","ness","nest","nets","news",
+  "next","nice","nick","niki","nile","nina","nine","niro","noah","node",
+  "nods","noel","noir","nome","nona","none","noon","nope","nora","norm",
+  "nose","note","noun","nova","nowt","nude","null","numb","nunn","nuns",
+  "nupe","nuts","oaks","oars","oath","oats","oban","obey","oboe","odds",
+  "oecd","offa","ohio","ohms","oils","oily","okay","olds","olga","oman",
+  "omar","omen","omit","once","ones","only","onto","onus","oops","opal",
+  "opcs","opec","open","oral","orcs","ores","orgy","oslo","otto","ould",
+  "ours","oust","outs","oval","oven","over","owed","owen","owes","owls",
+  "owns","oxen","pace","pack","pact","pads","page","pahl","paid","pain",
+  "pair","pale","pall","palm","pals","pane","pang","pans","papa","para",
+  "park","parr","part","pass","past","pate","path","paul","pave","pawn",
+  "paws","pays","peak","pear","peas","peat","peck","peel","peer","pegs",
+  "peng","penh","penn","pens","pepe","perm","pers","pert","peru","pest",
+  "pete","pets","pews","phew","phil","pick","pied","pier","pies","pigs",
+  "pike","pile","pill","pine","ping","pink","pins","pint","pipe","pips",
+  "pisa","piss","pits","pitt","pity","pius","plan","play","plea","plot",
+  "ploy","plug","plum","plus","pods","poem","poet","poke","pole","poll",
+  "polo","poly","pomp","pond","pons","pont","pony","pooh","pool","poor",
+  "pope","pops","pore","pork","porn","port","pose","posh","posi","post",
+  "pots","pour","pram","prat","pray","prep","pres","prey","prim","prix",
+  "prof","prop","pros","prow","pubs","puff","pugh","pull","pulp","pump",
+  "punk","punt","puny","pups","pure","push","puts","putt","quay","quid",
+  "quit","quiz","race","rack","racy","raft","rage","rags","raid","rail",
+  "rain","rake","ramp","rams","rang","rank","rape","rapt","rare","rash",
+  "rate","rats","rave","rays","rbge","rdbi","read","real","reap","rear",
+  "reds","reed","reef","reel","rees","refs","reid","rein","rely","rene",
+  "rent","reps","rest","retd","revd","revs","reza","rhee","riba","ribs",
+  "rica","rice","rich","rick","rico","ride","rife","rift","riga","rigs",
+  "rind","ring","rink","riot","ripe","risc","rise","risk","rita","rite",
+  "ritz","riva","rnli","road","roam","roar","robb","robe","rock","rode",
+  "rods","role","rolf","roll","roma","rome","roof","rook","room","root",
+  "rope","rory","rosa","rose","ross","rosy","rota","roth","rout","rowe",
+  "rows","rubs","ruby","ruck","rudd","rude","rugs","ruin","rule","rump",
+  "rune","rung","runs","ruse","rush","russ","rust","ruth","ryan","sack",
+  "safe","saga","sage","said","sail","sake","sale","salt","same","sand",
+  "sane","sang","sank","sans","sara","sash","saul","save","saws","says",
+  "sbus","scan","scar","scot","scsi","scum","seal","seam","sean","seas",
+  "seat","secs","sect","seed","seek","seem","seen","seep","sees","sega",
+  "sejm","self","sell","sema","semi","send","sent","sept","sera","serb",
+  "serc","seth","sets","seve","sewn","sexy","shae","shah","shai","sham",
+  "shaw","shed","shia","shih","shin","ship","shoe","shop","shot","show",
+  "shut","sick","side","sigh","sign","sikh","silk","sill","silt","sims",
+  "sine","sing","sink","sins","site","sits","size","skin","skip","skis",
+  "skye","slab","slag","slam","slap","slid","slim","slip","slit","slot",
+  "slow","slug","slum","slur","slut","smog","smug","snag","snap","snip",
+  "snob","snow","snub","snug","soak","soap","soar","sobs","sock","soda",
+  "sofa","soft","soho","soil","sold","sole","solo","some","song","sons",
+  "sony","soon","soot","sore","sort","soul","soup","sour","sown","sows",
+  "soya","span","spar","spat","spec","sped","spin","spit","spot","spun",
+  "spur","ssap","stab","stag","stan","star","stay","stem","step","stew",
+  "stir","stok","stop","stow","stub","stud","subs","such","suck","sued",
+  "suez","suit","sums","sung","sunk","suns","supt","sure","surf","suzi",
+  "suzy","swam","swan","swap","sway","swig","swim","tabs","tack","tact",
+  "taff","tags","tail","tait","take","tale","talk","tall","tame","tang",
+  "tank","tape","taps","tara","tart","task","tate","taut","taxi","teak",
+  "teal","team","tear","teas","tech","tecs","teen","tees","tell","tend",
+  "tens","tent","term","tess","test","text","thai","than","that","thaw",
+  "thee","them","then","theo","they","thin","this","thou","thud","thug",
+  "thus","tick","tide","tidy","tied","tier","ties","tile","till","tilt",
+  "time","tina","tins","tiny","tips","tire","tito","toad","toby","todd",
+  "toes","togo","toil","told","toll","tomb","tome","tone","toni","tons",
+  "tony","took","tool","tops","tore","torn","tort","tory","toss","tour",
+  "town","toys","tram","trap","tray","tree","trek","trim","trio","trip",
+  "trna","trod","trot","troy","true","tsar","tube","tubs","tuck","tuna",
+  "tune","tung","turf","turk","turn","tvei","twig","twin","twit","twos",
+  "tyne","type","tyre","ucta","uefa","ugly","uist","undo","unit","unix",
+  "unto","upon","urea","urge","urgh","used","user","uses","ussr","utah",
+  "vain","vale","vane","vans","vary","vase","vass","vast","vats","veal",
+  "veil","vein","vent","vera","verb","vern","very","vest","veto","vets",
+  "vial","vibe","vice","view","vile","vine","visa","vita","vivo","void",
+  "vole","volt","vote","vous","vows","wabi","wacc","wade","wage","wail",
+  "wait","wake","walk","wall","walt","wand","wang","want","ward","ware",
+  "warm","warn","warp","wars","wary","wash","wasp","watt","wave","wavy",
+  "ways","weak","wear","webb","webs","weed","week","weep","weir","well",
+  "went","wept","were","west","what","when","whig","whim","whip","whit",
+  "whoa","whom","wick","wide","wife","wigs","wild","will","wily","wind",
+  "wine","wing","wink","wins","wipe","wire","wiry","wise","wish","with",
+  "wits","woes","woke","wolf","womb","wont","wood","wool","word","wore",
+  "work","worm","worn","wove","wrap","wren","writ","wyre","yale","yang",
+  "yard","yarn","yawn","yeah","year","yell","yoga","yoke","yolk","york",
+  "your","yous","yuan","yuri","yves","zach","zack","zapt","zeal","zero",
+  "zest","zeta","zeus","zinc","zone","zoom","zoos","zzap"
+};
+
+
+/*
+ * Transform the first 6*chars bits of the binary string v into a chars
+ * character long string s. The encoding is a modification of the MIME
+ * base64 encoding where characters with easily confused glyphs are
+ * avoided (0 vs O, 1 vs. l vs. I).
+ */
+
+void conv_base64(char *s, const unsigned char *v, int chars)
+{
+  static const char tab[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijk%mnopqrstuvwxyz"
+    ":=23456789+/";
+  int i, j;
+  
+  for (i = 0; i < chars; i++) {
+    j = (i / 4) * 3;
+    switch (i % 4) {
+    case 0: *s++ = tab[  v[j]  >>2];                        break;
+    case 1: *s++ = tab[((v[j]  <<4) & 0x30) | (v[j+1]>>4)]; break;
+    case 2: *s++ = tab[((v[j+1]<<2) & 0x3c) | (v[j+2]>>6)]; break;
+    case 3: *s++ = tab[  v[j+2]     & 0x3f];                break;
+    }
+  }
+  *s++ = '\0';
+}
+
+
+/*
+ * Transform the first 5*chars bits of the binary string v into a chars
+ * character long string s. The encoding uses only lowercase letters
+ * and digit, in order to make it easy to communicate by voice (e.g.,
+ * using the NATO alphabet).
+ */
+
+void conv_base32(char *s, const unsigned char *v, int chars)
+{
+  static const char tab[] =
+    "abcdefghijkmnpqrstuvwxyz23456789";
+  int i, j = 0, k = 0;
+  
+  for (i = 0; i < chars; i++) {
+    if (k < 5) {
+      j = j << 8 | *(v++);
+      k += 8;
+    }
+    *s++ = tab[(j >> (k-5)) & 31];
+    k -= 5;
+  }
+  *s++ = '\0';
+}
+
+
+/*
+ * Normalize a password by removing whitespace etc. and converting
+ * l1| -> I, 0 -> O, \ -> /, just like otpw_verify() does.
+ */
+void pwnorm(char *password) {
+  char *src, *dst;
+  
+  src = dst = password;
+  while (1) {
+    if (*src == 'l' || *src == '1' || *src == '|')
+      *dst++ = 'I';
+    else if (*src == '0')
+      *dst++ = 'O';
+    else if (*src == '\\')
+      *dst++ = '/';
+    else if ((*src >= 'A' && *src <= 'Z') ||
+	     (*src >= 'a' && *src <= 'z') ||
+	     (*src >= '2' && *src <= '9') ||
+	     *src == ':' ||
+	     *src == '%' ||
+	     *src == '=' ||
+	     *src == '+' ||
+	     *src == '/')
+      *dst++ = *src;
+    else if (*src == '\0') {
+      *dst++ = *src;
+      return;
+    }
+    src++;
+  }
+}
+
+
+/*
+ * Convert a random bit sequence into a printable password
+ *
+ * Input:      vr        random bit string
+ *             vlen      length of vr in bytes
+ *             type      0: modified base-64 encoding
+ *                       1: sequence of 4-letter words
+ *                       2: base-32 encoding (lowercase plus digits)
+ *             entropy   requested minimum entropy of password
+ *             buf       buffer for returning zero-terminated output password
+ *             buflen    length of buffer in bytes
+ *
+ * Returns negative value if provided combination of vlen, type,
+ * ent and buflen are not adequate, otherwise return length of
+ * generated password (excluding terminating '\0').
+ *
+ * If buf == NULL, return value depends on buflen:
+ *
+ *  0:  length of password that would have been generated
+ *  1:  number of its non-space password characters
+ *  2:  actually used entropy if buflen == 2
+ *  3:  maximum entropy that can be specified for given vlen
+ */
+int make_passwd(const void *vr, int vlen, int type, int entropy,
+		char *buf, int buflen)
+{
+  int pwchars;   /* number of characters in password */
+  int pwlen;     /* length of password, including whitespace */
+  int emax;
+  int i, j, k;
+  const unsigned char *v = vr;
+
+  /* calculate length of output and actually used entropy */
+  switch (type) {
+  case PW_BASE32:
+    pwchars = (entropy + 4) / 5;
+    entropy = pwchars * 5;
+    pwlen = pwchars + (pwchars > 5 ? (pwchars - 1) / 4 : 0);
+    emax = ((vlen * 8) / 5) * 5;
+    break;
+  case PW_BASE64:
+    pwchars = (entropy + 5) / 6;
+    entropy = pwchars * 6;
+    pwlen = pwchars + (pwchars > 5 ? (pwchars - 1) / 4 : 0);
+    emax = ((vlen * 8) / 6) * 6;
+    break;
+  case PW_WORD4:
+    pwchars = 4 * ((entropy + 10) / 11);
+    entropy = 11 * ((entropy + 10) / 11);
+    pwlen = pwchars + pwchars / 4 - (pwchars > 0);
+    emax = ((vlen * 8) / 11) * 11;
+    break;
+  default:
+    return -1;
+  }
+
+  if (!buf) {
+    switch (buflen) {
+    case 0: return pwlen;      /* including spaces */
+    case 1: return pwchars;    /* excluding spaces */
+    case 2: return entropy;
+    case 3: return emax;
+    default: return -2;
+    }
+  }
+  if (entropy > vlen * 8)
+    return -3;
+  if (pwlen >= buflen)
+    return -4;
+
+  switch (type) {
+  case PW_BASE32:
+  case PW_BASE64:
+    if (type == PW_BASE32)
+      conv_base32(buf, v, pwchars);
+    else
+      conv_base64(buf, v, pwchars);
+    /* add spaces every 3-4 chars for readability (Bresenham's algorithm) */
+    i = pwchars - 1;
+    j = pwlen - 1;
+    k = (pwlen - pwchars) / 2;
+    while (i >= 0 && j >= 0) {
+      buf[j--] = buf[i--];
+      if ((k += pwlen - pwchars + 1) >= pwchars && j > 0) {
+	buf[j--] = ' ';
+	k -= pwchars;
+      }
+    }
+    buf[pwlen] = '\0';
+    break;
+  case PW_WORD4:
+    for (i = 0; i < pwchars/4; i++) {
+      k = 0;
+      for (j = i * 11; j < (i+1) * 11; j++)
+	k = (k << 1) | ((v[j / 8] >> (j % 8)) & 1);
+      memcpy(buf + i * 5, word[k], 4);
+      buf[i * 5 + 4] = ' ';
+    }
+    buf[i * 5 - 1] = '\0';
+    break;
+  default:
+    return -1;
+  }
+
+  assert((int) strlen(buf) == pwlen);
+
+  return pwlen;
+}
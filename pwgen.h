@@ -0,0 +1,23 @@
+/*
+ * Encoding of random bit strings as printable one-time passwords
+ *
+ * Markus Kuhn <http://www.cl.cam.ac.uk/~mgk25/>
+ */
+
+#ifndef PWGEN_H
+#define PWGEN_H
+
+/* password types for make_passwd() */
+#define PW_BASE64  0    /* modified base-64 encoding */
+#define PW_WORD4   1    /* sequence of 4-letter words */
+#define PW_BASE32  2    /* base-32 encoding (lowercase plus digits) */
+
+/* prototypes */
+
+void conv_base64(char *s, const unsigned char *v, int chars);
+void conv_base32(char *s, const unsigned char *v, int chars);
+void pwnorm(char *password);
+int make_passwd(const void *vr, int vlen, int type, int entropy,
+		char *buf, int buflen);
+
+#endif